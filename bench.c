@@ -0,0 +1,556 @@
+//
+// Microbenchmarks for the mem_pool hot paths: mem_new_alloc/mem_del_alloc
+// ns/op as a function of the number of gaps, the number of live
+// allocations, the request size distribution and the number of pools,
+// with system malloc/free for comparison where the pattern allows it.
+// The cache suite reports L1D/LLC misses per op (Linux perf events) for the
+// metadata layout. The index suite exercises the gap index trees; the
+// msl-clang-003-bench-gap-array build runs it against the sorted array and
+// the FIRST_FIT list walk. The warmup suite compares pools opened with and
+// without sizing hints, and with embedded metadata. The spec suite compares
+// mem_new_alloc with a MEM_POOL_SPECIALIZE-d allocator (the inline
+// mem_fast_alloc path, with the size fixed) for fixed-size objects.
+//
+// usage: msl-clang-003-bench [suite...]   (default: all suites)
+//
+
+#define _GNU_SOURCE // for clock_gettime() and syscall()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "mem_pool.h"
+#include "mem_pool_spec.h"
+
+
+/*****            constants            *****/
+
+static const unsigned BATCH          = 32;          // allocations per timed batch
+static const double   MIN_SECONDS    = 0.05;        // per measurement
+static const unsigned long MAX_BATCHES = 1u << 20;
+
+static const size_t   HOLE_SIZE      = 64;          // gaps suite: size of each hole
+static const size_t   LIVE_SIZE      = 64;          // live suite: size of each allocation
+static const size_t   PER_POOL_SIZE  = 4096;         // pools suite: size of each pool
+
+static const unsigned long SWEEP[]   = { 10, 100, 1000, 10000, 100000, 1000000 };
+static const unsigned NUM_SWEEP      = sizeof(SWEEP) / sizeof(SWEEP[0]);
+
+static const alloc_policy POLICIES[] = { FIRST_FIT, BEST_FIT };
+static const char *POLICY_NAMES[]    = { "FIRST_FIT", "BEST_FIT" };
+static const unsigned NUM_POLICIES   = sizeof(POLICIES) / sizeof(POLICIES[0]);
+
+static const size_t   SPEC_SIZE      = 32;          // spec suite: object size
+MEM_POOL_SPECIALIZE(spec_obj, 32, 16, FIRST_FIT)
+
+
+/*****             types               *****/
+
+// what one timed batch allocates from, and how its request sizes are drawn
+typedef struct _bench_ctx {
+    pool_pt *pools;         // NULL: use malloc/free
+    unsigned num_pools;
+    const size_t *sizes;    // request sizes, cycled through
+    size_t num_sizes;
+    size_t cursor;
+    void **batch;           // BATCH slots
+    pool_pt *owners;        // pool of each batch slot
+} bench_ctx_t;
+
+typedef struct _bench_result {
+    double alloc_ns;        // per mem_new_alloc (or malloc)
+    double free_ns;         // per mem_del_alloc (or free)
+    int ok;                 // 0 if setup or a batch allocation failed
+    unsigned long ops;      // allocations + frees timed
+} bench_result_t;
+
+// cache miss counters, fd -1 where the event isn't available
+typedef struct _miss_counters {
+    int l1d;                // L1 data cache read misses
+    int llc;                // last level cache misses
+} miss_counters_t;
+
+typedef struct _bench_suite {
+    const char *name;
+    void (*run)();
+} bench_suite_t;
+
+
+/*****         helper routines         *****/
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_header(const char *suite, const char *param) {
+    printf("\n# %s\n%-10s %12s %12s %12s\n", suite, param, "allocator", "alloc ns/op", "free ns/op");
+}
+
+static void print_result(unsigned long param, const char *allocator, bench_result_t r) {
+    if (r.ok)
+        printf("%-10lu %12s %12.1f %12.1f\n", param, allocator, r.alloc_ns, r.free_ns);
+    else
+        printf("%-10lu %12s %12s %12s\n", param, allocator, "n/a", "n/a");
+}
+
+// time batches of BATCH allocations followed by their frees (newest first,
+// so each batch leaves the pools as it found them) until MIN_SECONDS pass
+static bench_result_t measure(bench_ctx_t *ctx) {
+    bench_result_t r = { 0.0, 0.0, 1, 0 };
+    double alloc_s = 0.0, free_s = 0.0;
+    unsigned long batches = 0;
+    unsigned pool_ix = 0;
+
+    while ((alloc_s + free_s < MIN_SECONDS && batches < MAX_BATCHES) || batches == 0) {
+        double t0 = now_s();
+        for (unsigned i = 0; i < BATCH; ++i) {
+            size_t size = ctx->sizes[ctx->cursor];
+            if (++ctx->cursor == ctx->num_sizes) ctx->cursor = 0;
+
+            if (ctx->pools) {
+                pool_pt pool = ctx->pools[pool_ix];
+                if (++pool_ix == ctx->num_pools) pool_ix = 0;
+                ctx->owners[i] = pool;
+                ctx->batch[i] = mem_new_alloc(pool, size);
+            } else {
+                ctx->batch[i] = malloc(size);
+            }
+        }
+        double t1 = now_s();
+        for (unsigned i = BATCH; i-- > 0; ) {
+            if (!ctx->batch[i]) {
+                r.ok = 0;
+                continue;
+            }
+            if (ctx->pools) mem_del_alloc(ctx->owners[i], ctx->batch[i]);
+            else free(ctx->batch[i]);
+        }
+        double t2 = now_s();
+
+        alloc_s += t1 - t0;
+        free_s += t2 - t1;
+        batches ++;
+        if (!r.ok) return r;
+    }
+
+    r.alloc_ns = alloc_s * 1e9 / (batches * BATCH);
+    r.free_ns = free_s * 1e9 / (batches * BATCH);
+    r.ops = 2 * batches * BATCH;
+    return r;
+}
+
+static bench_result_t measure_pools(pool_pt *pools, unsigned num_pools,
+                                    const size_t *sizes, size_t num_sizes) {
+    void *batch[BATCH];
+    pool_pt owners[BATCH];
+    bench_ctx_t ctx = { pools, num_pools, sizes, num_sizes, 0, batch, owners };
+    return measure(&ctx);
+}
+
+static bench_result_t measure_malloc(const size_t *sizes, size_t num_sizes) {
+    void *batch[BATCH];
+    bench_ctx_t ctx = { NULL, 0, sizes, num_sizes, 0, batch, NULL };
+    return measure(&ctx);
+}
+
+// allocate count x size back to back; returns 0 if the pool ran out
+static int fill_pool(pool_pt pool, void **allocs, unsigned long count, size_t size) {
+    for (unsigned long i = 0; i < count; ++i)
+        if (!(allocs[i] = mem_new_alloc(pool, size))) return 0;
+    return 1;
+}
+
+static void drain_pool(pool_pt pool, void **allocs, unsigned long count) {
+    for (unsigned long i = 0; i < count; ++i)
+        if (allocs[i]) mem_del_alloc(pool, allocs[i]);
+}
+
+#ifdef __linux__
+static int open_counter(unsigned type, unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static miss_counters_t open_counters() {
+    miss_counters_t c = { -1, -1 };
+#ifdef __linux__
+    c.l1d = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    c.llc = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    return c;
+}
+
+static void start_counters(miss_counters_t *c) {
+#ifdef __linux__
+    if (c->l1d >= 0) { ioctl(c->l1d, PERF_EVENT_IOC_RESET, 0); ioctl(c->l1d, PERF_EVENT_IOC_ENABLE, 0); }
+    if (c->llc >= 0) { ioctl(c->llc, PERF_EVENT_IOC_RESET, 0); ioctl(c->llc, PERF_EVENT_IOC_ENABLE, 0); }
+#endif
+}
+
+// misses since start_counters, -1 if not available
+static double stop_counter(int fd) {
+    unsigned long long count = 0;
+    if (fd < 0) return -1.0;
+#ifdef __linux__
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+    return read(fd, &count, sizeof(count)) == sizeof(count) ? (double) count : -1.0;
+}
+
+static void print_misses(double misses, unsigned long ops) {
+    if (misses >= 0 && ops) printf(" %12.3f", misses / ops);
+    else printf(" %12s", "n/a");
+}
+
+
+/*****             suites              *****/
+
+// G holes of HOLE_SIZE between allocations; requests are larger than a
+// hole, so they are only satisfied by the tail gap (worst case search)
+static void bench_gaps() {
+    const size_t request = 2 * HOLE_SIZE;
+    print_header("gaps: requests that miss every hole", "gaps");
+
+    for (unsigned s = 0; s < NUM_SWEEP; ++s) {
+        unsigned long gaps = SWEEP[s];
+        for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+            bench_result_t r = { 0.0, 0.0, 0, 0 };
+            void **allocs = calloc(2 * gaps, sizeof(void *));
+            pool_pt pool = mem_pool_open(2 * gaps * HOLE_SIZE + BATCH * request, POLICIES[p]);
+
+            if (allocs && pool && fill_pool(pool, allocs, 2 * gaps, HOLE_SIZE)) {
+                for (unsigned long i = 0; i < 2 * gaps; i += 2) {
+                    mem_del_alloc(pool, allocs[i]);
+                    allocs[i] = NULL;
+                }
+                r = measure_pools(&pool, 1, &request, 1);
+            }
+            print_result(gaps, POLICY_NAMES[p], r);
+
+            if (pool) {
+                drain_pool(pool, allocs, 2 * gaps);
+                mem_pool_close(pool);
+            }
+            free(allocs);
+        }
+    }
+}
+
+// L live allocations ahead of the tail gap; the cost of mem_del_alloc
+// finding its node and of first-fit walking past them shows up here
+static void bench_live() {
+    print_header("live: allocations already in the pool", "live");
+
+    for (unsigned s = 0; s < NUM_SWEEP; ++s) {
+        unsigned long live = SWEEP[s];
+        for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+            bench_result_t r = { 0.0, 0.0, 0, 0 };
+            void **allocs = calloc(live, sizeof(void *));
+            pool_pt pool = mem_pool_open((live + BATCH) * LIVE_SIZE, POLICIES[p]);
+
+            if (allocs && pool && fill_pool(pool, allocs, live, LIVE_SIZE))
+                r = measure_pools(&pool, 1, &LIVE_SIZE, 1);
+            print_result(live, POLICY_NAMES[p], r);
+
+            if (pool) {
+                drain_pool(pool, allocs, live);
+                mem_pool_close(pool);
+            }
+            free(allocs);
+        }
+
+        // the same live set held by malloc
+        void **allocs = calloc(live, sizeof(void *));
+        for (unsigned long i = 0; allocs && i < live; ++i) allocs[i] = malloc(LIVE_SIZE);
+        print_result(live, "malloc", measure_malloc(&LIVE_SIZE, 1));
+        for (unsigned long i = 0; allocs && i < live; ++i) free(allocs[i]);
+        free(allocs);
+    }
+}
+
+// request size distributions on an empty pool
+static void bench_sizes() {
+    enum { NUM_DRAWS = 1024 };
+    static size_t sizes[NUM_DRAWS];
+    const char *names[] = { "fixed-16", "fixed-4096", "uniform", "log-uniform" };
+
+    printf("\n# sizes: request size distributions\n%-12s %12s %12s %12s\n",
+           "distribution", "allocator", "alloc ns/op", "free ns/op");
+
+    srand(1);
+    for (unsigned d = 0; d < 4; ++d) {
+        for (unsigned i = 0; i < NUM_DRAWS; ++i) {
+            switch (d) {
+                case 0: sizes[i] = 16; break;
+                case 1: sizes[i] = 4096; break;
+                case 2: sizes[i] = 1 + (size_t) rand() % 4096; break;
+                default: sizes[i] = ((size_t) 8 << (rand() % 10)) + (size_t) rand() % 8; break;
+            }
+        }
+
+        for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+            bench_result_t r = { 0.0, 0.0, 0, 0 };
+            pool_pt pool = mem_pool_open(BATCH * 8192, POLICIES[p]);
+            if (pool) {
+                r = measure_pools(&pool, 1, sizes, NUM_DRAWS);
+                mem_pool_close(pool);
+            }
+            if (r.ok) printf("%-12s %12s %12.1f %12.1f\n", names[d], POLICY_NAMES[p], r.alloc_ns, r.free_ns);
+            else printf("%-12s %12s %12s %12s\n", names[d], POLICY_NAMES[p], "n/a", "n/a");
+        }
+
+        bench_result_t r = measure_malloc(sizes, NUM_DRAWS);
+        printf("%-12s %12s %12.1f %12.1f\n", names[d], "malloc", r.alloc_ns, r.free_ns);
+    }
+}
+
+// allocations spread round-robin over P open pools
+static void bench_pools() {
+    const size_t request = 64;
+    print_header("pools: round-robin over open pools", "pools");
+
+    for (unsigned s = 0; s < NUM_SWEEP && SWEEP[s] <= 10000; ++s) {
+        unsigned long num_pools = SWEEP[s];
+        for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+            bench_result_t r = { 0.0, 0.0, 0, 0 };
+            pool_pt *pools = calloc(num_pools, sizeof(pool_pt));
+            unsigned long opened = 0;
+
+            while (pools && opened < num_pools &&
+                   (pools[opened] = mem_pool_open(PER_POOL_SIZE, POLICIES[p])))
+                ++ opened;
+            if (opened == num_pools)
+                r = measure_pools(pools, (unsigned) num_pools, &request, 1);
+            print_result(num_pools, POLICY_NAMES[p], r);
+
+            for (unsigned long i = 0; i < opened; ++i) mem_pool_close(pools[i]);
+            free(pools);
+        }
+    }
+}
+
+
+// G holes of assorted sizes (HOLE_SIZE and up) between allocations; BEST_FIT
+// requests of HOLE_SIZE take an exact hole each, so every op is a lower-bound
+// search plus an index removal (alloc) or insertion (free); FIRST_FIT
+// requests miss every hole, so they are satisfied by the tail gap only
+// after passing all of them (and, without the address tree, all allocations)
+static void bench_index() {
+    const size_t miss = 4 * HOLE_SIZE;
+    print_header("index: gap index search over holes of assorted sizes", "gaps");
+
+    for (unsigned s = 0; s < NUM_SWEEP; ++s) {
+        unsigned long gaps = SWEEP[s];
+        for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+            const size_t *request = POLICIES[p] == BEST_FIT ? &HOLE_SIZE : &miss;
+            bench_result_t r = { 0.0, 0.0, 0, 0 };
+            void **allocs = calloc(2 * gaps, sizeof(void *));
+            pool_pt pool = mem_pool_open(gaps * 4 * HOLE_SIZE + BATCH * miss, POLICIES[p]);
+            int ok = allocs && pool;
+
+            for (unsigned long i = 0; ok && i < 2 * gaps; ++i) {
+                size_t size = i % 2 ? HOLE_SIZE : HOLE_SIZE + (i / 2 % 16) * 8;
+                ok = (allocs[i] = mem_new_alloc(pool, size)) != NULL;
+            }
+            for (unsigned long i = 0; ok && i < 2 * gaps; i += 2) {
+                mem_del_alloc(pool, allocs[i]);
+                allocs[i] = NULL;
+            }
+            if (ok) r = measure_pools(&pool, 1, request, 1);
+            print_result(gaps, POLICY_NAMES[p], r);
+
+            if (pool) {
+                drain_pool(pool, allocs, 2 * gaps);
+                mem_pool_close(pool);
+            }
+            free(allocs);
+        }
+    }
+}
+
+// L1D/LLC misses per op with allocations round-robin over P pools, so
+// each op touches a different pool's mgr, node heap and gap index
+static void bench_cache() {
+    const size_t request = 64;
+    miss_counters_t c = open_counters();
+
+    printf("\n# cache: misses per op, round-robin over open pools\n%-10s %12s %12s %12s %12s\n",
+           "pools", "allocator", "alloc ns/op", "l1d miss/op", "llc miss/op");
+    if (c.l1d < 0 && c.llc < 0)
+        printf("# (perf events unavailable, see /proc/sys/kernel/perf_event_paranoid)\n");
+
+    for (unsigned s = 0; s < NUM_SWEEP && SWEEP[s] <= 10000; ++s) {
+        unsigned long num_pools = SWEEP[s];
+        for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+            bench_result_t r = { 0.0, 0.0, 0, 0 };
+            double l1d = -1.0, llc = -1.0;
+            pool_pt *pools = calloc(num_pools, sizeof(pool_pt));
+            unsigned long opened = 0;
+
+            while (pools && opened < num_pools &&
+                   (pools[opened] = mem_pool_open(PER_POOL_SIZE, POLICIES[p])))
+                ++ opened;
+            if (opened == num_pools) {
+                start_counters(&c);
+                r = measure_pools(pools, (unsigned) num_pools, &request, 1);
+                l1d = stop_counter(c.l1d);
+                llc = stop_counter(c.llc);
+            }
+
+            if (r.ok) {
+                printf("%-10lu %12s %12.1f", num_pools, POLICY_NAMES[p], r.alloc_ns);
+                print_misses(l1d, r.ops);
+                print_misses(llc, r.ops);
+                printf("\n");
+            } else {
+                print_result(num_pools, POLICY_NAMES[p], r);
+            }
+
+            for (unsigned long i = 0; i < opened; ++i) mem_pool_close(pools[i]);
+            free(pools);
+        }
+    }
+
+    if (c.l1d >= 0) close(c.l1d);
+    if (c.llc >= 0) close(c.llc);
+}
+
+// N allocations into a fresh pool and back out, opened with and without
+// sizing hints, and hinted with embedded metadata (open and close included);
+// unhinted pools grow their node heap and gap index on the way
+static void bench_warmup() {
+    static const char *VARIANTS[] = { "open", "open_ex", "embedded" };
+
+    print_header("warmup: filling a fresh pool", "allocs");
+
+    for (unsigned s = 0; s < NUM_SWEEP; ++s) {
+        unsigned long count = SWEEP[s];
+        unsigned long reps = count < 100000 ? 100000 / count : 1;
+        pool_open_opts_t opts = { (unsigned) count, 0, 1, 0 };
+
+        for (int variant = 0; variant < 3; ++variant) {
+            bench_result_t r = { 0.0, 0.0, 1, 0 };
+            void **allocs = calloc(count, sizeof(void *));
+            double alloc_s = 0.0, free_s = 0.0;
+
+            for (unsigned long rep = 0; r.ok && rep < reps; ++rep) {
+                opts.flags = variant == 2 ? MEM_OPEN_EMBEDDED : 0;
+                double t0 = now_s();
+                pool_pt pool = mem_pool_open_ex(count * LIVE_SIZE, FIRST_FIT, variant ? &opts : NULL);
+                r.ok = allocs && pool && fill_pool(pool, allocs, count, LIVE_SIZE);
+                double t1 = now_s();
+                if (r.ok) drain_pool(pool, allocs, count);
+                if (pool) mem_pool_close(pool);
+                double t2 = now_s();
+                alloc_s += t1 - t0;
+                free_s += t2 - t1;
+            }
+            r.alloc_ns = alloc_s * 1e9 / (reps * count);
+            r.free_ns = free_s * 1e9 / (reps * count);
+            print_result(count, VARIANTS[variant], r);
+            free(allocs);
+        }
+    }
+}
+
+// N fixed-size objects allocated and freed in turn: through mem_new_alloc,
+// a specialized allocator in a pool of the same policy, and malloc
+static void bench_spec() {
+    static const char *VARIANTS[] = { "generic", "specialized", "malloc" };
+    print_header("spec: fixed-size objects", "live");
+
+    for (unsigned s = 0; s < NUM_SWEEP; ++s) {
+        unsigned long count = SWEEP[s];
+        unsigned long reps = count < 1000000 ? 1000000 / count : 1;
+        size_t pool_size = count * SPEC_SIZE * 2 + 65536;
+        void **objs = calloc(count, sizeof(void *));
+
+        for (int variant = 0; variant < 3; ++variant) {
+            bench_result_t r = { 0.0, 0.0, objs != NULL, 0 };
+            double alloc_s = 0.0, free_s = 0.0;
+            pool_pt pool = NULL;
+            spec_obj_t spec = { 0 };
+
+            if (variant == 0) r.ok = r.ok && (pool = mem_pool_open(pool_size, FIRST_FIT));
+            if (variant == 1) r.ok = r.ok && spec_obj_open(&spec, pool_size);
+
+            for (unsigned long rep = 0; r.ok && rep < reps; ++rep) {
+                double t0 = now_s();
+                for (unsigned long i = 0; i < count; ++i) {
+                    if (variant == 0) objs[i] = mem_new_alloc(pool, SPEC_SIZE);
+                    else if (variant == 1) objs[i] = spec_obj_alloc(&spec);
+                    else objs[i] = malloc(SPEC_SIZE);
+                }
+                double t1 = now_s();
+                for (unsigned long i = count; i-- > 0; ) {
+                    if (!objs[i]) r.ok = 0;
+                    else if (variant == 0) mem_del_alloc(pool, objs[i]);
+                    else if (variant == 1) spec_obj_free(&spec, objs[i]);
+                    else free(objs[i]);
+                }
+                double t2 = now_s();
+                alloc_s += t1 - t0;
+                free_s += t2 - t1;
+            }
+
+            if (pool) mem_pool_close(pool);
+            if (variant == 1 && spec.pool) spec_obj_close(&spec);
+            r.alloc_ns = alloc_s * 1e9 / (reps * count);
+            r.free_ns = free_s * 1e9 / (reps * count);
+            print_result(count, VARIANTS[variant], r);
+        }
+        free(objs);
+    }
+}
+
+
+/*****              main               *****/
+
+static const bench_suite_t SUITES[] = {
+        { "gaps",  bench_gaps },
+        { "live",  bench_live },
+        { "sizes", bench_sizes },
+        { "pools", bench_pools },
+        { "cache", bench_cache },
+        { "index", bench_index },
+        { "warmup", bench_warmup },
+        { "spec", bench_spec },
+};
+static const unsigned NUM_SUITES = sizeof(SUITES) / sizeof(SUITES[0]);
+
+int main(int argc, char *argv[]) {
+    if (mem_init() != ALLOC_OK) return 1;
+
+    for (unsigned s = 0; s < NUM_SUITES; ++s) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; ++a)
+            if (strcmp(argv[a], SUITES[s].name) == 0) selected = 1;
+        if (!selected) continue;
+
+        SUITES[s].run();
+        fflush(stdout);
+    }
+
+    return mem_free() == ALLOC_OK ? 0 : 1;
+}
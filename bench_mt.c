@@ -0,0 +1,263 @@
+//
+// Multi-threaded scaling benchmark: N workers doing a mix of mem_new_alloc
+// and mem_del_alloc under three contention profiles, reporting ops/sec for
+// 1, 2, 4, ... up to the given number of threads.
+//
+//   shared   - one pool for all workers, serialized by a mutex
+//   private  - one pool per worker, no sharing
+//   cross    - one pool per worker, but every allocation is handed to the
+//              next worker, which frees it into the owner's pool
+//
+// note: the library is not thread-safe, so sharing is done by the benchmark
+//       with a mutex per pool; pools are opened before the workers start
+//
+// usage: msl-clang-003-mt-bench [max_threads [seconds]]
+//
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "mem_pool.h"
+
+
+/*****            constants            *****/
+
+static const unsigned DEFAULT_MAX_THREADS = 64;
+static const double   DEFAULT_SECONDS     = 0.2;    // per configuration
+static const unsigned WORKING_SET         = 32;     // live slots per worker
+static const unsigned INBOX_CAPACITY      = 1024;   // cross: pending frees per worker
+static const size_t   MAX_REQUEST         = 256;
+static const size_t   POOL_SIZE_PER_WORKER = 1 << 20;
+
+typedef enum _profile { SHARED, PRIVATE, CROSS } profile_t;
+static const char *PROFILE_NAMES[] = { "shared", "private", "cross" };
+
+
+/*****             types               *****/
+
+typedef struct _bench_pool {
+    pool_pt pool;
+    pthread_mutex_t lock;
+} bench_pool_t;
+
+// cross profile: allocations waiting to be freed by this worker
+typedef struct _inbox {
+    pthread_mutex_t lock;
+    void **allocs;
+    bench_pool_t **owners;
+    unsigned count;
+} inbox_t;
+
+typedef struct _worker {
+    unsigned id;
+    profile_t profile;
+    bench_pool_t *pool;         // where this worker allocates
+    inbox_t *inbox;             // cross: own inbox
+    inbox_t *next_inbox;        // cross: where handed-off allocations go
+    atomic_int *stop;
+    unsigned long ops;
+    unsigned long failed;
+    char pad[64];               // keep counters of neighbouring workers apart
+} worker_t;
+
+
+/*****         helper routines         *****/
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned next_rand(unsigned *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+static void *pool_alloc(bench_pool_t *bp, size_t size) {
+    pthread_mutex_lock(&bp->lock);
+    void *alloc = mem_new_alloc(bp->pool, size);
+    pthread_mutex_unlock(&bp->lock);
+    return alloc;
+}
+
+static void pool_free(bench_pool_t *bp, void *alloc) {
+    pthread_mutex_lock(&bp->lock);
+    mem_del_alloc(bp->pool, alloc);
+    pthread_mutex_unlock(&bp->lock);
+}
+
+// cross: free whatever the previous worker handed over
+static void drain_inbox(worker_t *w) {
+    inbox_t *inbox = w->inbox;
+    pthread_mutex_lock(&inbox->lock);
+    for (unsigned i = 0; i < inbox->count; ++i) {
+        pool_free(inbox->owners[i], inbox->allocs[i]);
+        w->ops ++;
+    }
+    inbox->count = 0;
+    pthread_mutex_unlock(&inbox->lock);
+}
+
+// cross: returns 0 if the next worker's inbox is full
+static int hand_off(worker_t *w, void *alloc) {
+    inbox_t *inbox = w->next_inbox;
+    int ok = 0;
+    pthread_mutex_lock(&inbox->lock);
+    if (inbox->count < INBOX_CAPACITY) {
+        inbox->allocs[inbox->count] = alloc;
+        inbox->owners[inbox->count] = w->pool;
+        inbox->count ++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&inbox->lock);
+    return ok;
+}
+
+
+/*****            workers              *****/
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    void *slots[WORKING_SET];
+    unsigned seed = 7919u * (w->id + 1);
+
+    memset(slots, 0, sizeof(slots));
+
+    while (!atomic_load_explicit(w->stop, memory_order_relaxed)) {
+        unsigned r = next_rand(&seed);
+        unsigned slot = r % WORKING_SET;
+
+        if (w->profile == CROSS) {
+            drain_inbox(w);
+            void *alloc = pool_alloc(w->pool, 1 + (r >> 8) % MAX_REQUEST);
+            w->ops ++;
+            if (!alloc) w->failed ++;
+            else if (!hand_off(w, alloc)) pool_free(w->pool, alloc);
+            continue;
+        }
+
+        // shared and private: toggle a random slot of the working set
+        if (slots[slot]) {
+            pool_free(w->pool, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = pool_alloc(w->pool, 1 + (r >> 8) % MAX_REQUEST);
+            if (!slots[slot]) w->failed ++;
+        }
+        w->ops ++;
+    }
+
+    for (unsigned i = 0; i < WORKING_SET; ++i)
+        if (slots[i]) pool_free(w->pool, slots[i]);
+
+    return NULL;
+}
+
+
+/*****               run               *****/
+
+static int run(profile_t profile, unsigned num_threads, double seconds) {
+    unsigned num_pools = profile == SHARED ? 1 : num_threads;
+    bench_pool_t *pools = calloc(num_pools, sizeof(bench_pool_t));
+    inbox_t *inboxes = calloc(num_threads, sizeof(inbox_t));
+    worker_t *workers = calloc(num_threads, sizeof(worker_t));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    atomic_int stop = 0;
+
+    if (!pools || !inboxes || !workers || !threads) return 0;
+
+    // the pool store is not thread-safe, so open everything up front
+    for (unsigned p = 0; p < num_pools; ++p) {
+        size_t size = POOL_SIZE_PER_WORKER * (profile == SHARED ? num_threads : 1);
+        if (!(pools[p].pool = mem_pool_open(size, FIRST_FIT))) return 0;
+        pthread_mutex_init(&pools[p].lock, NULL);
+    }
+    for (unsigned t = 0; t < num_threads; ++t) {
+        pthread_mutex_init(&inboxes[t].lock, NULL);
+        inboxes[t].allocs = calloc(INBOX_CAPACITY, sizeof(void *));
+        inboxes[t].owners = calloc(INBOX_CAPACITY, sizeof(bench_pool_t *));
+        if (!inboxes[t].allocs || !inboxes[t].owners) return 0;
+    }
+
+    for (unsigned t = 0; t < num_threads; ++t) {
+        workers[t].id = t;
+        workers[t].profile = profile;
+        workers[t].pool = &pools[profile == SHARED ? 0 : t];
+        workers[t].inbox = &inboxes[t];
+        workers[t].next_inbox = &inboxes[(t + 1) % num_threads];
+        workers[t].stop = &stop;
+    }
+
+    double start = now_s();
+    for (unsigned t = 0; t < num_threads; ++t)
+        pthread_create(&threads[t], NULL, worker_main, &workers[t]);
+
+    struct timespec pause = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&pause, NULL);
+    atomic_store(&stop, 1);
+
+    for (unsigned t = 0; t < num_threads; ++t)
+        pthread_join(threads[t], NULL);
+    double elapsed = now_s() - start;
+
+    // whatever is still in flight goes back to its pool
+    unsigned long ops = 0, failed = 0;
+    for (unsigned t = 0; t < num_threads; ++t) {
+        drain_inbox(&workers[t]);
+        ops += workers[t].ops;
+        failed += workers[t].failed;
+    }
+
+    printf("%-8s %8u %14.0f %14.0f %9.3f%%\n",
+           PROFILE_NAMES[profile], num_threads, ops / elapsed, ops / elapsed / num_threads,
+           ops ? 100.0 * failed / ops : 0.0);
+    fflush(stdout);
+
+    for (unsigned p = 0; p < num_pools; ++p) {
+        mem_pool_close(pools[p].pool);
+        pthread_mutex_destroy(&pools[p].lock);
+    }
+    for (unsigned t = 0; t < num_threads; ++t) {
+        pthread_mutex_destroy(&inboxes[t].lock);
+        free(inboxes[t].allocs);
+        free(inboxes[t].owners);
+    }
+    free(threads);
+    free(workers);
+    free(inboxes);
+    free(pools);
+    return 1;
+}
+
+
+/*****              main               *****/
+
+int main(int argc, char *argv[]) {
+    unsigned max_threads = argc >= 2 ? (unsigned) strtoul(argv[1], NULL, 10) : DEFAULT_MAX_THREADS;
+    double seconds = argc >= 3 ? strtod(argv[2], NULL) : DEFAULT_SECONDS;
+
+    if (max_threads == 0 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [max_threads [seconds]]\n", argv[0]);
+        return 2;
+    }
+    if (mem_init() != ALLOC_OK) return 1;
+
+    printf("%-8s %8s %14s %14s %10s\n", "profile", "threads", "ops/s", "ops/s/thread", "failed");
+    for (profile_t profile = SHARED; profile <= CROSS; ++profile) {
+        for (unsigned n = 1; n <= max_threads; n *= 2) {
+            if (!run(profile, n, seconds)) {
+                fprintf(stderr, "%s: setup failed at %u threads\n", PROFILE_NAMES[profile], n);
+                return 1;
+            }
+        }
+    }
+
+    return mem_free() == ALLOC_OK ? 0 : 1;
+}
@@ -2,10 +2,33 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#define _GNU_SOURCE // for clock_gettime(), mmap() flags and flock()
+
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
 #include <memory.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h> // for FALLOC_FL_PUNCH_HOLE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h> // for sched_yield()
+#include <stdatomic.h>
+
+#if defined(MEM_POOL_LATENCY_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h> // for __rdtsc()
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h> // for _mm_stream_si128()
+#endif
 
 #include "mem_pool.h"
 
@@ -29,6 +52,66 @@ static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
 static const float      MEM_GAP_IX_FILL_FACTOR          = 0.75;
 static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
 
+static const unsigned   MEM_NIL                         = (unsigned) -1;
+
+#define MEM_CACHE_LINE 64
+
+// file-backed pools can't grow their metadata in place, so it is sized
+// up front: one node per this many bytes of pool (sparse until touched)
+static const size_t     MEM_FILE_BYTES_PER_NODE         = 64;
+static const uint64_t   MEM_FILE_MAGIC                  = 0x4c4f4f504d454d31ull; // "1MEMPOOL"
+static const uint32_t   MEM_FILE_VERSION                = 8;
+// the gap index is laid out differently by the two builds, and a file
+// records which one wrote it
+#ifdef MEM_POOL_GAP_ARRAY
+static const uint32_t   MEM_FILE_GAP_IX                 = 1; // sorted array
+#else
+static const uint32_t   MEM_FILE_GAP_IX                 = 2; // treaps
+#endif
+
+// snapshot stream: a header, the segments in address order, then the
+// contents of the allocated segments in the same order (gaps aren't written)
+static const uint64_t   MEM_SNAPSHOT_MAGIC              = 0x50414e534d454d31ull; // "1MEMSNAP"
+static const uint32_t   MEM_SNAPSHOT_VERSION            = 1;
+static const unsigned   MEM_SNAPSHOT_SEG_BATCH          = 256; // segments per write()/read()
+
+// NUMA placement, with the kernel's mbind() modes (see <numaif.h>)
+#define MEM_NUMA_MAX_NODES 1024
+static const int        MEM_MPOL_BIND                   = 2;
+static const int        MEM_MPOL_INTERLEAVE             = 3;
+static const unsigned   MEM_MPOL_F_MEMS_ALLOWED         = 1u << 2;
+
+// clones of a template tell the pages it has written from /proc/self/pagemap,
+// this many entries at a time
+#define MEM_PAGEMAP_BATCH 512
+
+// how long attaching to a shared pool waits for its creator to set it up
+static const unsigned   MEM_SHARED_ATTACH_TRIES         = 1000;
+static const long       MEM_SHARED_ATTACH_WAIT_NS       = 1000000;
+
+// zeroed allocations at least this large bypass the cache
+static const size_t     MEM_ZERO_STREAM_MIN             = 256 * 1024;
+
+// maintenance: gaps at least this large have their pages released, smaller
+// dirty ones are cleared, up to the budget per pool and pass; the pool lock
+// is held for at most so many gaps and bytes at a time
+static const size_t     MEM_MAINT_RELEASE_MIN           = 64 * 1024;
+static const size_t     MEM_MAINT_ZERO_BUDGET           = 1024 * 1024;
+static const unsigned   MEM_MAINT_HOLD_GAPS             = 64;
+static const size_t     MEM_MAINT_HOLD_BYTES            = 64 * 1024;
+
+// ADAPTIVE pools decide how to place requests every window of allocations:
+// first-fit while there are fewer than one free per MEM_ADAPT_BULK_RATIO
+// allocations (unless its mean search gets longer than MEM_ADAPT_MAX_SEARCH),
+// best-fit otherwise, with size classes if at least MEM_ADAPT_CLUSTERED
+// percent of the requests fell in MEM_ADAPT_CLASSES classes
+#define MEM_ADAPT_CLASSES 8
+static const unsigned   MEM_ADAPT_WINDOW                = 1024;
+static const unsigned   MEM_ADAPT_BULK_RATIO            = 4;
+static const unsigned   MEM_ADAPT_MAX_SEARCH            = 64;
+static const unsigned   MEM_ADAPT_CLUSTERED             = 90;
+static const size_t     MEM_ADAPT_MIN_CLASS             = 16; // then 4 classes per power of 2
+
 
 
 /*********************/
@@ -36,32 +119,213 @@ static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
 /* Type declarations */
 /*                   */
 /*********************/
+// note: the metadata holds offsets and node indices rather than pointers,
+//       so it stays valid wherever the pool happens to be mapped
 typedef struct _alloc {
-    char *mem;
+    size_t offset; // from pool.mem
     size_t size;
 } alloc_t, *alloc_pt;
 
+// note: node_t and gap_t divide the cache line, and the node heap and gap
+//       index are line aligned, so no entry straddles two lines
 typedef struct _node {
     alloc_t alloc_record;
-    unsigned used;
-    unsigned allocated;
-    struct _node *next, *prev; // doubly-linked list for gap deletion
+    unsigned used : 1;
+    unsigned allocated : 1;
+    unsigned zeroed : 1; // gaps only: all bytes known to be zero
+    unsigned next, prev; // doubly-linked list for gap deletion, MEM_NIL at the ends
 } node_t, *node_pt;
 
+// the gap index is a treap ordered by (size, offset), its entries are
+// indexed like the nodes they stand for; a second treap over the same
+// entries is ordered by offset alone, for FIRST_FIT; building with
+// MEM_POOL_GAP_ARRAY keeps the original sorted array (entries
+// 0..num_gaps-1) for comparison, and FIRST_FIT walks the node list
 typedef struct _gap {
-    size_t size;
-    node_pt node;
+    size_t size;   // 0 if the entry isn't in the index
+    unsigned node; // index in the node heap
 } gap_t, *gap_pt;
 
+// follows the gap_ix entries, in the same allocation
+typedef struct _gap_link {
+    unsigned left, right; // MEM_NIL if none
+} gap_link_t, *gap_link_pt;
+
+// follows the gap_link_t-s, max is the largest gap size in the subtree
+typedef struct _gap_addr_link {
+    size_t max;
+    unsigned left, right; // MEM_NIL if none
+} gap_addr_link_t, *gap_addr_link_pt;
+
+// ADAPTIVE: what the pool has seen since its last decision
+typedef struct _adapt_sample {
+    unsigned allocs;
+    unsigned frees;
+    unsigned long search_len;
+    unsigned other;                         // requests outside the classes below
+    unsigned slow_first_fit;                // kept across windows, until churn starts
+    size_t class_size[MEM_ADAPT_CLASSES];   // size classes requested, 0 if none yet
+    unsigned class_count[MEM_ADAPT_CLASSES];
+} adapt_sample_t;
+
+// the allocation lookup of mem_del_alloc follows the gap index in the same
+// block: an open-addressing hash table of the allocated nodes by offset,
+// MEM_ALLOC_IX_SLOTS per gap index entry (so never more than half full);
+// a slot holds the node index + 1, 0 if empty, so a zeroed block is empty
+#define MEM_ALLOC_IX_SLOTS 2
+// mem_pool_clear removes the allocations one by one below 1 per this many
+// entries, and wipes the table above
+#define MEM_ALLOC_IX_CLEAR_RATIO 16
+
+_Static_assert(MEM_CACHE_LINE % sizeof(node_t) == 0, "node_t must divide a cache line");
+_Static_assert(MEM_CACHE_LINE % sizeof(gap_t) == 0, "gap_t must divide a cache line");
+_Static_assert(MEM_CACHE_LINE % sizeof(gap_link_t) == 0, "gap_link_t must divide a cache line");
+_Static_assert(MEM_CACHE_LINE % sizeof(gap_addr_link_t) == 0, "gap_addr_link_t must divide a cache line");
+
+// where the pool and its metadata live, decides how they are released
+typedef enum _mem_backing {
+    MEM_BACKING_HEAP,   // separate malloc-s for the pool, node heap and gap index
+    MEM_BACKING_ANON,   // as HEAP, but the pool is an anonymous mapping
+    MEM_BACKING_FILE,   // one shared mapping of a file, manager included
+    MEM_BACKING_SHARED, // a POSIX shared memory object with the file layout,
+                        // the manager is a per-process proxy of the one in it
+    MEM_BACKING_CLONE,  // a private mapping of a template's memfd, or a copy
+                        // of another pool's memory, with malloc-ed copies of
+                        // its node heap and gap index
+    MEM_BACKING_EMBEDDED, // one anonymous mapping holding the manager, node
+                        // heap and gap index ahead of the pool
+    MEM_BACKING_CALLER, // memory the caller owns, of unknown contents and kind
+    MEM_BACKING_SUB,    // an allocation in another pool, returned on close
+    MEM_BACKING_MEMFD   // as ANON, but a mapping of a memfd, which clones
+                        // map privately
+} mem_backing;
+
+// note: the first cache line holds everything mem_new_alloc and
+//       mem_del_alloc read (the pool counters and the metadata heads), the
+//       counters they only write follow, the rest is cold; mgrs are line
+//       aligned and a whole number of lines, so two pools never share one
 typedef struct _pool_mgr {
-    pool_t pool;
+    _Alignas(MEM_CACHE_LINE) pool_t pool;
     node_pt node_heap;
     unsigned total_nodes;
     unsigned used_nodes;
     gap_pt gap_ix;
-    unsigned gap_ix_capacity;
+    // line 1
+    unsigned free_node;         // released nodes, linked through next, MEM_NIL if none
+    unsigned node_top;          // nodes from here on have never been used
+    unsigned gap_root;          // of the treap, MEM_NIL if empty
+    unsigned gap_addr_root;     // of the address-ordered treap, MEM_NIL if empty
+    gap_link_pt gap_tree;       // right after the gap_ix entries
+    gap_addr_link_pt gap_addr;  // right after the gap_tree links
+    unsigned *alloc_ix;         // right after the gap index, see _mem_alloc_ix_find()
+    unsigned gap_ix_capacity;   // >= total_nodes
+    unsigned long search_len;   // total nodes/entries examined by mem_new_alloc
+    pool_stats_t stats;         // counters kept up to date on the hot path
+    adapt_sample_t adapt;       // ADAPTIVE only
+    // cold
+    unsigned id;                // unique per process, names the pool in traces
+    mem_backing backing;
+    void *map;                  // FILE/SHARED/EMBEDDED: the whole mapping, ANON/CLONE: pool.mem
+    size_t map_size;
+    int fd;
+    struct _pool_mgr *shared;   // MEM_BACKING_SHARED: the manager in the mapping
+    struct _pool_mgr *parent;   // MEM_BACKING_SUB: the pool the memory came from,
+                                // CLONE: the template whose memfd it maps, if any
+    unsigned subpools;          // open sub-pools carved from this pool
+    unsigned clones;            // MEMFD: open clones mapping the memfd
+    int frozen;                 // MEMFD: the pool memory is a private mapping of
+                                // the memfd since the first clone
+    unsigned long resets;       // _mem_pool_reset calls, i.e. opens and clears
+    size_t maint_offset;        // maintenance: the gap the next lock hold starts at
+    size_t maint_done;          // ... bytes of it already released or cleared
+    unsigned long maint_changes; // ... _mem_pool_changes() when that was done
+    pthread_mutex_t maint_lock; // taken by every operation while maintenance runs
+    // written by the inline fast path, so on lines of its own
+    _Alignas(MEM_CACHE_LINE) pool_fast_t fast;
+#ifdef MEM_POOL_LATENCY
+    latency_hist_pt latency;    // MEM_LAT_NUM_OPS histograms
+#endif
 } pool_mgr_t, *pool_mgr_pt;
 
+_Static_assert(offsetof(pool_mgr_t, gap_ix) + sizeof(gap_pt) <= MEM_CACHE_LINE,
+               "the hot fields of pool_mgr_t must fit in one cache line");
+
+// first bytes of a file-backed pool, followed by the pool manager; the
+// node heap, gap index and pool memory are at the recorded offsets
+typedef struct _pool_file_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t mgr_size;      // sizeof(pool_mgr_t) of the writer
+    uint32_t gap_ix_layout; // MEM_FILE_GAP_IX of the writer
+    uint64_t node_heap_off;
+    uint64_t gap_ix_off;
+    uint64_t mem_off;
+    uint64_t map_size;
+    pthread_mutex_t lock;   // process-shared, only used by shared pools
+} pool_file_hdr_t;
+
+// the manager follows the header in the first page of the file
+#define MEM_FILE_MGR_OFF ((sizeof(pool_file_hdr_t) + 63) & ~(size_t) 63)
+
+typedef struct _pool_snapshot_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t policy;
+    uint64_t total_size;
+    uint64_t num_segments;
+} pool_snapshot_hdr_t;
+
+typedef struct _pool_snapshot_seg {
+    uint64_t size;
+    uint64_t allocated;
+} pool_snapshot_seg_t;
+
+
+
+/*******************************/
+/*                             */
+/* Latency instrumentation     */
+/*                             */
+/*******************************/
+#ifdef MEM_POOL_LATENCY
+#define MEM_LAT_BEGIN(t)            unsigned long long t = _mem_lat_now()
+#define MEM_LAT_END(mgr, op, t)     _mem_lat_record((mgr), (op), _mem_lat_now() - (t))
+#else
+#define MEM_LAT_BEGIN(t)
+#define MEM_LAT_END(mgr, op, t)
+#endif
+
+
+
+/*******************************/
+/*                             */
+/* Event tracing               */
+/*                             */
+/*******************************/
+#ifdef MEM_POOL_TRACE
+#ifndef MEM_TRACE_RING_CAPACITY
+#define MEM_TRACE_RING_CAPACITY (1u << 16) // records per thread, power of 2
+#endif
+
+// each thread appends to its own ring, so recording takes no locks;
+// rings are linked into a global list on first use and live until exit
+typedef struct _trace_ring {
+    trace_record_t records[MEM_TRACE_RING_CAPACITY];
+    _Atomic uint64_t head;      // total records ever written
+    unsigned thread_id;
+    struct _trace_ring *next;
+} trace_ring_t, *trace_ring_pt;
+
+static _Atomic(trace_ring_pt) trace_rings = NULL;
+static atomic_uint trace_next_thread_id = 0;
+static _Thread_local trace_ring_pt trace_ring = NULL;
+
+#define MEM_TRACE(op, id, offset, size, result) \
+                            _mem_trace_record((op), (id), (offset), (size), (result))
+#else
+#define MEM_TRACE(op, id, offset, size, result)
+#endif
+
 
 
 /***************************/
@@ -72,6 +336,19 @@ typedef struct _pool_mgr {
 static pool_mgr_pt* pool_store = NULL; // an array of pointers, only expand
 static unsigned pool_store_size = 0;
 static unsigned pool_store_capacity = 0;
+static unsigned pool_next_id = 0;
+
+// held while the store changes, and by maintenance passes while they walk it
+static pthread_mutex_t pool_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the maintenance thread, see mem_maint_start()
+// note: maint_active only changes while no other thread is in the library
+static atomic_int maint_active = 0;
+static pthread_t maint_thread;
+static pthread_mutex_t maint_mutex = PTHREAD_MUTEX_INITIALIZER; // for maint_stop
+static pthread_cond_t maint_cond = PTHREAD_COND_INITIALIZER;
+static int maint_stop = 0;
+static unsigned maint_interval_ms = 0;
 
 
 
@@ -93,6 +370,89 @@ static alloc_status
                                 node_pt node);
 static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
 static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr);
+static node_pt _mem_gap_ix_lower_bound(pool_mgr_pt pool_mgr, size_t size, unsigned *search_len);
+static node_pt _mem_gap_ix_first_fit(pool_mgr_pt pool_mgr, size_t size, unsigned *search_len);
+static node_pt _mem_gap_ix_next(pool_mgr_pt pool_mgr, size_t offset);
+static size_t _mem_gap_ix_largest(pool_mgr_pt pool_mgr);
+static void _mem_gap_ix_clear(pool_mgr_pt pool_mgr);
+static size_t _mem_gap_ix_bytes(unsigned capacity);
+static void _mem_gap_ix_bind(pool_mgr_pt pool_mgr);
+static alloc_status _mem_gap_ix_grow(pool_mgr_pt pool_mgr, unsigned capacity);
+static unsigned _mem_node_get(pool_mgr_pt pool_mgr);
+static void _mem_node_put(pool_mgr_pt pool_mgr, node_pt node);
+static size_t _mem_alloc_ix_home(pool_mgr_pt pool_mgr, size_t offset);
+static void _mem_alloc_ix_insert(pool_mgr_pt pool_mgr, unsigned node);
+static node_pt _mem_alloc_ix_find(pool_mgr_pt pool_mgr, size_t offset);
+static void _mem_alloc_ix_remove(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_alloc_ix_rebuild(pool_mgr_pt pool_mgr);
+#ifndef MEM_POOL_GAP_ARRAY
+static int _mem_gap_less(pool_mgr_pt pool_mgr, unsigned a, unsigned b);
+static unsigned _mem_gap_prio(unsigned gap);
+static unsigned _mem_gap_tree_insert(pool_mgr_pt pool_mgr, unsigned root, unsigned gap);
+static unsigned _mem_gap_tree_remove(pool_mgr_pt pool_mgr, unsigned root, unsigned gap);
+static unsigned _mem_gap_tree_merge(pool_mgr_pt pool_mgr, unsigned left, unsigned right);
+static void _mem_gap_addr_update(pool_mgr_pt pool_mgr, unsigned gap);
+static unsigned _mem_gap_addr_insert(pool_mgr_pt pool_mgr, unsigned root, unsigned gap);
+static unsigned _mem_gap_addr_remove(pool_mgr_pt pool_mgr, unsigned root, unsigned gap);
+static unsigned _mem_gap_addr_merge(pool_mgr_pt pool_mgr, unsigned left, unsigned right);
+#endif
+static unsigned _mem_gap_hist_bucket(size_t size);
+static size_t _mem_size_class(size_t size);
+static void _mem_adapt_sample(pool_mgr_pt pool_mgr, size_t size, unsigned search_len);
+static void _mem_adapt_decide(pool_mgr_pt pool_mgr);
+static void * _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size, int zero);
+static void _mem_zero(char *mem, size_t size);
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, void *alloc);
+static void * _mem_line_calloc(size_t count, size_t size);
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, unsigned capacity);
+static pool_pt _mem_pool_open_on(char *mem, size_t size, alloc_policy policy,
+                                 mem_backing backing, unsigned capacity);
+static unsigned _mem_pool_capacity(size_t size, const pool_open_opts_t *opts);
+static pool_pt _mem_pool_open_numa(size_t size, alloc_policy policy, int node);
+static pool_pt _mem_pool_open_file(const char *path, size_t size, alloc_policy policy);
+static pool_pt _mem_pool_open_embedded(size_t size, alloc_policy policy, unsigned capacity);
+static pool_pt _mem_pool_open_memfd(size_t size, alloc_policy policy, unsigned capacity);
+static pool_pt _mem_pool_open_shared(const char *name, size_t size, alloc_policy policy);
+static pool_pt _mem_subpool_open(pool_mgr_pt parent, size_t size, alloc_policy policy);
+static alloc_status _mem_file_layout(size_t size, pool_file_hdr_t *hdr);
+static int _mem_file_valid(const pool_file_hdr_t *hdr, off_t file_size);
+static void _mem_pool_copy_state(pool_mgr_pt to, const pool_mgr_t *from);
+static alloc_status _mem_pool_snapshot(pool_mgr_pt pool_mgr, int fd);
+static pool_pt _mem_pool_restore(int fd);
+static pool_pt _mem_pool_clone(pool_mgr_pt parent);
+static char * _mem_clone_memfd(pool_mgr_pt parent);
+static void _mem_copy_written(const char *from, char *to, size_t size);
+static int _mem_write_all(int fd, const void *buf, size_t size);
+static int _mem_read_all(int fd, void *buf, size_t size);
+static void _mem_pool_lock(pool_mgr_pt pool_mgr);
+static void _mem_pool_unlock(pool_mgr_pt pool_mgr);
+static int _mem_pool_trylock(pool_mgr_pt pool_mgr);
+static void * _mem_maint_main(void *arg);
+static void _mem_maint_pass();
+static int _mem_pool_maintain(pool_mgr_pt pool_mgr, size_t *budget);
+static unsigned long _mem_pool_changes(pool_mgr_pt pool_mgr);
+static int _mem_gap_releasable(pool_mgr_pt pool_mgr);
+static void _mem_gap_clean(pool_mgr_pt pool_mgr, char *start, char *end, int release);
+static alloc_status _mem_pool_register(pool_mgr_pt pool_mgr);
+static void _mem_pool_init(pool_mgr_pt pool_mgr, size_t size, alloc_policy policy);
+static void _mem_pool_reset(pool_mgr_pt pool_mgr, int zeroed);
+static alloc_status _mem_pool_clear(pool_mgr_pt pool_mgr);
+static void _mem_fast_scatter(pool_fast_pt fast);
+static unsigned long _mem_fast_chunks(pool_mgr_pt pool_mgr);
+static void _mem_fast_release(pool_mgr_pt pool_mgr);
+static node_pt _mem_node_next(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_node_prev(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_pool_close(pool_mgr_pt pool_mgr, int force);
+#ifdef MEM_POOL_TRACE
+static void _mem_trace_record(trace_op op, unsigned pool_id,
+                              uint64_t offset, uint64_t size, unsigned result);
+#endif
+#ifdef MEM_POOL_LATENCY
+static unsigned long long _mem_lat_now();
+static void _mem_lat_record(pool_mgr_pt pool_mgr, latency_op op, unsigned long long value);
+static unsigned _mem_lat_bucket(unsigned long long value);
+#endif
+static unsigned long long _mem_lat_bucket_high(unsigned bucket);
 
 
 
@@ -136,6 +496,9 @@ alloc_status mem_free()
             if(pool_store[i]) return ALLOC_NOT_FREED;
         }
 
+        // the maintenance thread walks the store, so it goes first
+        if (atomic_load(&maint_active)) mem_maint_stop();
+
         // can free the pool store array
         free(pool_store);
         // update static variables
@@ -149,374 +512,2985 @@ alloc_status mem_free()
 }
 
 
-pool_pt mem_pool_open(size_t size, alloc_policy policy)
+alloc_status mem_maint_start(unsigned interval_ms)
 {
-    // make sure the pool store is allocated
-    if(!pool_store) return NULL;
-
-    // expand the pool store, if necessary
-    if (((float) pool_store_size / pool_store_capacity) > MEM_POOL_STORE_FILL_FACTOR)
+    if (!pool_store || interval_ms == 0) return ALLOC_FAIL;
+    if (atomic_load(&maint_active)) return ALLOC_CALLED_AGAIN;
+
+    // pool operations start locking from here on
+    atomic_store(&maint_active, 1);
+    maint_stop = 0;
+    maint_interval_ms = interval_ms;
+    if (pthread_create(&maint_thread, NULL, _mem_maint_main, NULL) != 0)
     {
-        alloc_status result = _mem_resize_pool_store();
-        if(result == ALLOC_FAIL)
-            return NULL;
+        atomic_store(&maint_active, 0);
+        return ALLOC_FAIL;
     }
 
-    // allocate a new mem pool mgr
-    //this is a pointer to a new pool mgr that will be connected to the pool store
-    pool_mgr_pt new_mem_pool_mgr = (pool_mgr_pt)malloc(sizeof(pool_mgr_t));
-    // check success, on error return null
-    if(!new_mem_pool_mgr) return NULL;
+    return ALLOC_OK;
+}
 
-    // allocate a new memory pool
-    char* new_mem_pool = malloc(size);
-    // check success, on error deallocate mgr and return null
-    if(!new_mem_pool)
-    {
-        free(new_mem_pool_mgr);
-        return NULL;
-    }
 
-    // allocate a new node heap
-    node_pt new_node_heap = (node_pt)calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
-    // check success, on error deallocate mgr/pool and return null
-    if(!new_node_heap) {
-        free(new_mem_pool);
-        free(new_mem_pool_mgr);
-        return NULL;
-    }
+alloc_status mem_maint_stop()
+{
+    if (!atomic_load(&maint_active)) return ALLOC_CALLED_AGAIN;
 
-    // allocate a new gap index
-    gap_pt new_gap_index = (gap_pt)calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-    // check success, on error deallocate mgr/pool/heap and return null
-    if(!new_gap_index)
-    {
-        free(new_node_heap);
-        free(new_mem_pool);
-        free(new_mem_pool_mgr);
-        return NULL;
-    }
+    pthread_mutex_lock(&maint_mutex);
+    maint_stop = 1;
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_mutex);
+    pthread_join(maint_thread, NULL);
 
-    // assign all the pointers and update meta data:
-    //initialize pool manager
-    new_mem_pool_mgr->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
-    new_mem_pool_mgr->used_nodes = 1;
-    //add pool to pool manager
-    new_mem_pool_mgr->pool.mem = new_mem_pool;
-    new_mem_pool_mgr->pool.policy = policy;
-    new_mem_pool_mgr->pool.total_size = size;
-    new_mem_pool_mgr->pool.alloc_size = 0;
-    new_mem_pool_mgr->pool.num_allocs = 0;
-    new_mem_pool_mgr->pool.num_gaps = 1;
+    atomic_store(&maint_active, 0);
 
-    //   initialize top node of node heap
-    new_node_heap->alloc_record.mem = new_mem_pool;
-    new_node_heap->alloc_record.size = size;
-    new_node_heap->used = 1;
-    new_node_heap->allocated = 0;
-    new_node_heap->prev = NULL;
-    new_node_heap->next = NULL;
-
-    //add node heap to pool manager
-    new_mem_pool_mgr->node_heap = new_node_heap;
+    return ALLOC_OK;
+}
 
-    //   initialize top node of gap index
-    _mem_add_to_gap_ix(new_mem_pool_mgr, size, new_node_heap);
 
-    //   link pool mgr to pool store
-    pool_store[pool_store_size++] = new_mem_pool_mgr;
+alloc_status mem_maint_run()
+{
+    if (!pool_store) return ALLOC_FAIL;
 
-    // return the address of the mgr, cast to (pool_pt)
+    _mem_maint_pass();
 
-    return (pool_pt)new_mem_pool_mgr;
+    return ALLOC_OK;
 }
 
 
-alloc_status mem_pool_close(pool_pt pool)
+pool_pt mem_pool_open(size_t size, alloc_policy policy)
 {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt current_pool_mgr_pt = (pool_mgr_pt) pool;
+    pool_pt pool = _mem_pool_open(size, policy, MEM_NODE_HEAP_INIT_CAPACITY);
 
-    // check if this pool is allocated
-    if (!(pool->mem))
-        return ALLOC_NOT_FREED;
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              policy, size, pool ? ALLOC_OK : ALLOC_FAIL);
 
-    // check if pool has only one gap
-    if (pool->num_gaps != 1)
-        return ALLOC_NOT_FREED;
+    return pool;
+}
 
-    // check if it has zero allocations
-    if (pool->num_allocs != 0)
-        return ALLOC_NOT_FREED;
 
-    // free memory pool
-    free(pool->mem);
-    // free node heap
-    free(current_pool_mgr_pt->node_heap);
-    // free gap index
-    free(current_pool_mgr_pt->gap_ix);
+pool_pt mem_pool_open_ex(size_t size, alloc_policy policy, const pool_open_opts_t *opts)
+{
+    unsigned capacity = _mem_pool_capacity(size, opts);
+    unsigned flags = opts ? opts->flags : 0;
+    pool_pt pool = NULL;
+
+    // an embedded pool's memory shares its mapping with the metadata, so
+    // it can't be a template
+    if (!(flags & MEM_OPEN_TEMPLATE))
+        pool = flags & MEM_OPEN_EMBEDDED ?
+               _mem_pool_open_embedded(size, policy, capacity) :
+               _mem_pool_open(size, policy, capacity);
+    else if (!(flags & MEM_OPEN_EMBEDDED))
+        pool = _mem_pool_open_memfd(size, policy, capacity);
+
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              policy, size, pool ? ALLOC_OK : ALLOC_FAIL);
+
+    return pool;
+}
 
-    // find mgr in pool store and set to null
-    for (int index = 0; index < pool_store_size; ++index)
-    {
-        if (pool_store[index] == current_pool_mgr_pt)
-        {
-            pool_store[index] = NULL;
-            break;
-        }
-    }
 
-    // note: don't decrement pool_store_size, because it only grows
-    // free mgr
-    free(current_pool_mgr_pt);
+pool_pt mem_pool_open_on(void *buf, size_t size, alloc_policy policy)
+{
+    pool_pt pool = NULL;
 
-    return ALLOC_OK;
+    if (buf && size)
+        pool = _mem_pool_open_on(buf, size, policy, MEM_BACKING_CALLER, MEM_NODE_HEAP_INIT_CAPACITY);
+
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              policy, size, pool ? ALLOC_OK : ALLOC_FAIL);
+
+    return pool;
 }
 
 
-void * mem_new_alloc(pool_pt pool, size_t size) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt current_pool_mgr_pt = (pool_mgr_pt) pool;
+pool_pt mem_subpool_open(pool_pt parent, size_t size, alloc_policy policy)
+{
+    pool_pt pool = _mem_subpool_open((pool_mgr_pt) parent, size, policy);
 
-    // check if any gaps, return null if none
-    if (pool->num_gaps == 0)
-        return 0;
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              policy, size, pool ? ALLOC_OK : ALLOC_FAIL);
 
-    // expand heap node, if necessary, quit on error
-    // NOT CURRENTLY NECESSARY BUT CALL IT ANYWAY
-    alloc_status result = _mem_resize_node_heap(current_pool_mgr_pt);
-    assert(result == ALLOC_OK);
+    return pool;
+}
 
-    // check used nodes fewer than total nodes, quit on error
-    if (current_pool_mgr_pt->used_nodes < current_pool_mgr_pt->total_nodes)
-        return NULL;
 
-    // get a node for allocation:
-    node_pt new_node_pt = (node_pt) malloc(sizeof(node_t));
+pool_pt mem_pool_open_numa(size_t size, alloc_policy policy, int node)
+{
+    pool_pt pool = _mem_pool_open_numa(size, policy, node);
 
-    assert((pool->policy == FIRST_FIT) || (pool->policy == BEST_FIT));
-    if (pool->policy == FIRST_FIT)
-    {
-        // if FIRST_FIT, then find the first sufficient node in the node heap
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              policy, size, pool ? ALLOC_OK : ALLOC_FAIL);
 
-    }
-    else
-    {
-        // if BEST_FIT, then find the first sufficient node in the gap index
+    return pool;
+}
 
-    }
 
-    // check if node found
-    // update metadata (num_allocs, alloc_size)
-    pool->num_allocs += 1;
-    pool->alloc_size += size;
+int mem_numa_local_node()
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int) node;
+#endif
+    // no NUMA information, everything is on node 0
+    return 0;
+}
 
-    // calculate the size of the remaining gap, if any
-    // remove node from gap index
-    // convert gap_node to an allocation node of given size
 
-    // adjust node heap:
-    //   if remaining gap, need a new node
-    //   find an unused one in the node heap
-    //   make sure one was found
-    //   initialize it to a gap node
-    //   update metadata (used_nodes)
-    //   update linked list (new node right after the node for allocation)
-    //   add to gap index
-    //   check if successful
-    // return allocation record by casting the node to (alloc_pt)
+pool_pt mem_pool_open_file(const char *path, size_t size, alloc_policy policy)
+{
+    pool_pt pool = _mem_pool_open_file(path, size, policy);
 
-    // TEMPORARY VALUE:
-    return (alloc_pt*) pool;
-//    return NULL;
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              pool ? pool->policy : policy, pool ? pool->total_size : size,
+              pool ? ALLOC_OK : ALLOC_FAIL);
+
+    return pool;
 }
 
-alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    // get node from alloc by casting the pointer to (node_pt)
-    // find the node in the node heap
-    // this is node-to-delete
-    // make sure it's found
-    // convert to gap node
-    // update metadata (num_allocs, alloc_size)
-    // if the next node in the list is also a gap, merge into node-to-delete
-    //   remove the next node from gap index
-    //   check success
-    //   add the size to the node-to-delete
-    //   update node as unused
-    //   update metadata (used nodes)
-    //   update linked list:
-    /*
-                    if (next->next) {
-                        next->next->prev = node_to_del;
-                        node_to_del->next = next->next;
-                    } else {
-                        node_to_del->next = NULL;
-                    }
-                    next->next = NULL;
-                    next->prev = NULL;
-     */
 
-    // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
-    // if the previous node in the list is also a gap, merge into previous!
-    //   remove the previous node from gap index
-    //   check success
-    //   add the size of node-to-delete to the previous
-    //   update node-to-delete as unused
-    //   update metadata (used_nodes)
-    //   update linked list
-    /*
-                    if (node_to_del->next) {
-                        prev->next = node_to_del->next;
-                        node_to_del->next->prev = prev;
-                    } else {
-                        prev->next = NULL;
-                    }
-                    node_to_del->next = NULL;
-                    node_to_del->prev = NULL;
-     */
-    //   change the node to add to the previous node!
-    // add the resulting node to the gap index
-    // check success
+pool_pt mem_pool_open_shared(const char *name, size_t size, alloc_policy policy)
+{
+    pool_pt pool = _mem_pool_open_shared(name, size, policy);
 
-    return ALLOC_FAIL;
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              pool ? pool->policy : policy, pool ? pool->total_size : size,
+              pool ? ALLOC_OK : ALLOC_FAIL);
+
+    return pool;
 }
 
-void mem_inspect_pool(pool_pt pool,
-                      pool_segment_pt *segments,
-                      unsigned *num_segments) {
-    // get the mgr from the pool
-    // allocate the segments array with size == used_nodes
-    // check successful
-    // loop through the node heap and the segments array
-    //    for each node, write the size and allocated in the segment
-    // "return" the values:
-    /*
-                    *segments = segs;
-                    *num_segments = pool_mgr->used_nodes;
-     */
+
+alloc_status mem_pool_unlink_shared(const char *name)
+{
+    return shm_unlink(name) == 0 ? ALLOC_OK : ALLOC_FAIL;
 }
 
 
+alloc_status mem_pool_snapshot(pool_pt pool, int fd)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-/***********************************/
-/*                                 */
-/* Definitions of static functions */
-/*                                 */
-/***********************************/
-static alloc_status _mem_resize_pool_store() {
+    if (!pool || fd < 0) return ALLOC_FAIL;
 
-    // ALLOCATE NEW POOL STORE OF CAPACITY: (pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR)
-    pool_mgr_pt* new_pool_store = (pool_mgr_pt*)malloc(pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR);
-    if(!new_pool_store) return ALLOC_FAIL;
-    
-    // COPY EACH ELEMENT OF OLD POOL STORE TO NEW POOL STORE
-    for(int i = 0; i < pool_store_capacity; ++i)
-    {
-        new_pool_store[i] = pool_store[i];
-    }
-    pool_store_capacity = (pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR);
+    _mem_pool_lock(pool_mgr);
+    alloc_status result = _mem_pool_snapshot(pool_mgr, fd);
+    _mem_pool_unlock(pool_mgr);
 
-    // FREE OLD POOL STORE (BUT NOT ITS ELEMENTS)
-    free(pool_store);
-    pool_store = new_pool_store;
-    free(new_pool_store);
+    return result;
+}
 
-    return ALLOC_OK;
+
+pool_pt mem_pool_restore(int fd)
+{
+    pool_pt pool = _mem_pool_restore(fd);
+
+    MEM_TRACE(MEM_TRACE_OPEN, pool ? ((pool_mgr_pt) pool)->id : 0,
+              pool ? pool->policy : 0, pool ? pool->total_size : 0,
+              pool ? ALLOC_OK : ALLOC_FAIL);
+
+    return pool;
 }
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
-    // see above
-    // check if necessary
-/*
-    if (((float) pool_mgr->total_nodes / pool_store_capacity)
-        > MEM_POOL_STORE_FILL_FACTOR)
-    {
-        // ALLOCATE NEW POOL STORE OF CAPACITY: (pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR)
-        // COPY EACH ELEMENT OF OLD POOL STORE TO NEW POOL STORE
-        // SET pool_store_capactity = (pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR)
-        // FREE OLD POOL STORE (BUT NOT ITS ELEMENTS)
 
-        return ALLOC_OK;
-    }
-    else return ALLOC_FAIL;
-*/
-    return ALLOC_OK;
+pool_pt mem_pool_clone(pool_pt pool)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool) return NULL;
+
+    _mem_pool_lock(pool_mgr);
+    pool_pt clone = _mem_pool_clone(pool_mgr);
+    _mem_pool_unlock(pool_mgr);
+
+    MEM_TRACE(MEM_TRACE_OPEN, clone ? ((pool_mgr_pt) clone)->id : 0,
+              pool->policy, pool->total_size, clone ? ALLOC_OK : ALLOC_FAIL);
+
+    return clone;
 }
 
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
-    // see above
 
-    return ALLOC_OK;
-//    return ALLOC_FAIL;
+size_t mem_pool_offset(pool_pt pool, const void *alloc)
+{
+    return (size_t) ((const char *) alloc - pool->mem);
 }
 
-/*
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
-                                       size_t size,
-                                       node_pt node) {
 
-    // expand the gap index, if necessary (call the function)
-    // add the entry at the end
-    // update metadata (num_gaps)
-    // sort the gap index (call the function)
-    // check success
+void * mem_pool_ptr(pool_pt pool, size_t offset)
+{
+    return pool->mem + offset;
+}
 
-    return ALLOC_FAIL;
+
+alloc_status mem_pool_sync(pool_pt pool)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool) return ALLOC_FAIL;
+
+    // only file-backed pools have anything to write back
+    if (pool_mgr->backing != MEM_BACKING_FILE && pool_mgr->backing != MEM_BACKING_SHARED)
+        return ALLOC_OK;
+
+    return msync(pool_mgr->map, pool_mgr->map_size, MS_SYNC) == 0 ? ALLOC_OK : ALLOC_FAIL;
 }
-*/
 
 
-// THIS CODE PROVIDED BY INSTRUCTOR
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node)
+alloc_status mem_pool_close(pool_pt pool)
 {
+    if (!pool) return ALLOC_NOT_FREED;
 
-    // resize the gap index, if necessary
-    alloc_status result = _mem_resize_gap_ix(pool_mgr);
-    assert(result == ALLOC_OK);
-    if (result != ALLOC_OK) return ALLOC_FAIL;
+    // the mgr is gone after a successful close, so keep its id
+    unsigned id = ((pool_mgr_pt) pool)->id;
+    alloc_status result = _mem_pool_close((pool_mgr_pt) pool, 0);
 
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
-    pool_mgr->pool.num_gaps ++;
+    MEM_TRACE(MEM_TRACE_CLOSE, id, 0, 0, result);
+    (void) id;
+
+    return result;
+}
 
-    // sort the gap index after addition
-    result = _mem_sort_gap_ix(pool_mgr);
-    assert(result == ALLOC_OK);
-    if (result != ALLOC_OK) return ALLOC_FAIL;
 
+alloc_status mem_pool_close_force(pool_pt pool)
+{
+    if (!pool) return ALLOC_NOT_FREED;
+
+    unsigned id = ((pool_mgr_pt) pool)->id;
+    alloc_status result = _mem_pool_close((pool_mgr_pt) pool, 1);
+
+    MEM_TRACE(MEM_TRACE_CLOSE, id, 0, 0, result);
+    (void) id;
 
     return result;
 }
 
-static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
-                                            size_t size,
-                                            node_pt node) {
-    // find the position of the node in the gap index
-    // loop from there to the end of the array:
-    //    pull the entries (i.e. copy over) one position up
-    //    this effectively deletes the chosen node
-    // update metadata (num_gaps)
-    // zero out the element at position num_gaps!
 
-    return ALLOC_FAIL;
+alloc_status mem_pool_clear(pool_pt pool)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool) return ALLOC_FAIL;
+
+    _mem_pool_lock(pool_mgr);
+    alloc_status result = _mem_pool_clear(pool_mgr);
+    _mem_pool_unlock(pool_mgr);
+
+    MEM_TRACE(MEM_TRACE_CLEAR, pool_mgr->id, 0, 0, result);
+
+    return result;
 }
 
-// note: only called by _mem_add_to_gap_ix, which appends a single entry
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
-    // the new entry is at the end, so "bubble it up"
-    // loop from num_gaps - 1 until but not including 0:
-    //    if the size of the current entry is less than the previous (u - 1)
-    //    or if the sizes are the same but the current entry points to a
-    //    node with a lower address of pool allocation address (mem)
-    //       swap them (by copying) (remember to use a temporary variable)
 
-    return ALLOC_OK;
-//    return ALLOC_FAIL;
+void * mem_new_alloc(pool_pt pool, size_t size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    _mem_pool_lock(pool_mgr);
+    MEM_LAT_BEGIN(start);
+    void *alloc = _mem_new_alloc(pool_mgr, size, 0);
+    MEM_LAT_END(pool_mgr, MEM_LAT_ALLOC, start);
+    _mem_pool_unlock(pool_mgr);
+
+    MEM_TRACE(MEM_TRACE_ALLOC, pool_mgr->id,
+              alloc ? (uint64_t) ((char *) alloc - pool->mem) : UINT64_MAX,
+              size, alloc ? ALLOC_OK : ALLOC_FAIL);
+
+    return alloc;
 }
 
-static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr) {
-    return ALLOC_FAIL;
+void * mem_new_alloc_zeroed(pool_pt pool, size_t size) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    _mem_pool_lock(pool_mgr);
+    MEM_LAT_BEGIN(start);
+    void *alloc = _mem_new_alloc(pool_mgr, size, 1);
+    MEM_LAT_END(pool_mgr, MEM_LAT_ALLOC, start);
+    _mem_pool_unlock(pool_mgr);
+
+    MEM_TRACE(MEM_TRACE_ALLOC, pool_mgr->id,
+              alloc ? (uint64_t) ((char *) alloc - pool->mem) : UINT64_MAX,
+              size, alloc ? ALLOC_OK : ALLOC_FAIL);
+
+    return alloc;
+}
+
+alloc_status mem_del_alloc(pool_pt pool, void * alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    _mem_pool_lock(pool_mgr);
+    MEM_LAT_BEGIN(start);
+    alloc_status result = _mem_del_alloc(pool_mgr, alloc);
+    MEM_LAT_END(pool_mgr, MEM_LAT_FREE, start);
+    _mem_pool_unlock(pool_mgr);
+
+    MEM_TRACE(MEM_TRACE_FREE, pool_mgr->id,
+              alloc ? (uint64_t) ((char *) alloc - pool->mem) : UINT64_MAX, 0, result);
+
+    return result;
 }
 
+pool_fast_pt mem_pool_fast(pool_pt pool) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool) return NULL;
+    if (pool_mgr->backing == MEM_BACKING_FILE || pool_mgr->backing == MEM_BACKING_SHARED)
+        return NULL;
+
+    // the mgr was zeroed at open (or clone), the rest starts out empty
+    pool_mgr->fast.pool = pool;
+
+    return &pool_mgr->fast;
+}
+
+void * mem_fast_refill(pool_fast_pt fast, size_t size) {
+    if (!fast || size == 0 || size > MEM_FAST_MAX) return NULL;
+
+    size_t bytes = ((size - 1) / MEM_FAST_GRAIN + 1) * MEM_FAST_GRAIN;
+    // room for the link to the next chunk, and for aligning the objects
+    size_t header = sizeof(void *) + MEM_FAST_GRAIN - 1;
+
+    _mem_fast_scatter(fast);
+
+    // a pool too small (or too full) for a whole chunk gets a smaller one
+    char *chunk = NULL;
+    for (size_t chunk_size = MEM_FAST_CHUNK; !chunk && chunk_size >= header + bytes; chunk_size /= 2)
+    {
+        chunk = mem_new_alloc(fast->pool, chunk_size);
+        if (chunk) fast->end = chunk + chunk_size;
+    }
+    if (!chunk) return NULL;
+
+    memcpy(chunk, &fast->chunks, sizeof(void *));
+    fast->chunks = chunk;
+    fast->next = (char *) (((uintptr_t) chunk + sizeof(void *) + MEM_FAST_GRAIN - 1) &
+                           ~(uintptr_t) (MEM_FAST_GRAIN - 1));
+
+    return mem_fast_alloc(fast, size);
+}
+
+void mem_inspect_pool(pool_pt pool,
+                      pool_segment_pt *segments,
+                      unsigned *num_segments) {
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    _mem_pool_lock(pool_mgr);
+
+    // allocate the segments array with size == used_nodes
+    pool_segment_pt segs = (pool_segment_pt) calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+    // check successful
+    if (!segs) {
+        _mem_pool_unlock(pool_mgr);
+        *segments = NULL;
+        *num_segments = 0;
+        return;
+    }
+
+    // loop through the node heap and the segments array
+    //    for each node, write the size and allocated in the segment
+    unsigned u = 0;
+    for (node_pt node = pool_mgr->node_heap; node && u < pool_mgr->used_nodes;
+         node = _mem_node_next(pool_mgr, node), ++u)
+    {
+        segs[u].size = node->alloc_record.size;
+        segs[u].allocated = node->allocated;
+    }
+
+    // "return" the values:
+    *segments = segs;
+    *num_segments = pool_mgr->used_nodes;
+
+    _mem_pool_unlock(pool_mgr);
+}
+
+alloc_status mem_pool_stats(pool_pt pool, pool_stats_pt stats) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool || !stats) return ALLOC_FAIL;
+
+    // the counters and the gap histogram are kept current by the hot path,
+    // only the derived values are computed here (the largest gap is the
+    // end of the gap array, or down the right spine of the size treap, so
+    // O(log n) in the number of gaps)
+    _mem_pool_lock(pool_mgr);
+    *stats = pool_mgr->stats;
+
+    stats->free_size = pool->total_size - pool->alloc_size;
+    stats->largest_gap = _mem_gap_ix_largest(pool_mgr);
+    unsigned long search_len = pool_mgr->search_len;
+    _mem_pool_unlock(pool_mgr);
+    stats->fragmentation = stats->free_size ?
+                           1.0 - (double) stats->largest_gap / stats->free_size : 0.0;
+
+    unsigned long searches = stats->alloc_count + stats->fail_count;
+    stats->avg_search_len = searches ? (double) search_len / searches : 0.0;
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_pool_latency(pool_pt pool, latency_op op, latency_hist_pt hist) {
+#ifdef MEM_POOL_LATENCY
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool || !hist || op >= MEM_LAT_NUM_OPS) return ALLOC_FAIL;
+
+    // the hot path records into the histograms under the same lock
+    _mem_pool_lock(pool_mgr);
+    *hist = pool_mgr->latency[op];
+    _mem_pool_unlock(pool_mgr);
+
+    return ALLOC_OK;
+#else
+    // not an instrumentation build
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_latency_reset(pool_pt pool) {
+#ifdef MEM_POOL_LATENCY
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (!pool) return ALLOC_FAIL;
+
+    _mem_pool_lock(pool_mgr);
+    memset(pool_mgr->latency, 0, MEM_LAT_NUM_OPS * sizeof(latency_hist_t));
+    _mem_pool_unlock(pool_mgr);
+
+    return ALLOC_OK;
+#else
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_trace_dump(const char *path) {
+#ifdef MEM_POOL_TRACE
+    // one look at the list and at each ring's head: the header counts, and
+    // each ring is written up to, what it held then; rings only ever get
+    // added in front, so the list from here on doesn't change
+    trace_ring_pt rings = atomic_load(&trace_rings);
+    size_t num_rings = 0;
+    for (trace_ring_pt ring = rings; ring; ring = ring->next) ++num_rings;
+
+    uint64_t *heads = (uint64_t *) malloc((num_rings ? num_rings : 1) * sizeof(uint64_t));
+    if (!heads) return ALLOC_FAIL;
+
+    // count what the rings still hold, each keeps its most recent records
+    trace_file_header_t header = { MEM_TRACE_MAGIC, MEM_TRACE_VERSION,
+                                   sizeof(trace_record_t), 0, 0 };
+    size_t r = 0;
+    for (trace_ring_pt ring = rings; ring; ring = ring->next, ++r)
+    {
+        heads[r] = atomic_load_explicit(&ring->head, memory_order_acquire);
+        header.count += heads[r] < MEM_TRACE_RING_CAPACITY ? heads[r] : MEM_TRACE_RING_CAPACITY;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        free(heads);
+        return ALLOC_FAIL;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    // write each ring oldest first; readers merge the threads by timestamp
+    r = 0;
+    for (trace_ring_pt ring = rings; ring && ok; ring = ring->next, ++r)
+    {
+        uint64_t first = heads[r] > MEM_TRACE_RING_CAPACITY ? heads[r] - MEM_TRACE_RING_CAPACITY : 0;
+        for (uint64_t i = first; i < heads[r] && ok; ++i)
+            ok = fwrite(&ring->records[i & (MEM_TRACE_RING_CAPACITY - 1)],
+                        sizeof(trace_record_t), 1, file) == 1;
+    }
+
+    free(heads);
+    if (fclose(file) != 0) ok = 0;
+
+    return ok ? ALLOC_OK : ALLOC_FAIL;
+#else
+    // not a tracing build
+    (void) path;
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_trace_reset() {
+#ifdef MEM_POOL_TRACE
+    // note: only safe while no other thread is recording
+    for (trace_ring_pt ring = atomic_load(&trace_rings); ring; ring = ring->next)
+        atomic_store(&ring->head, 0);
+
+    return ALLOC_OK;
+#else
+    return ALLOC_FAIL;
+#endif
+}
+
+unsigned long long mem_latency_percentile(const latency_hist_t *hist, double q) {
+    if (!hist || !hist->count) return 0;
+
+    // walk up to the bucket holding the q-th sample, report its upper bound
+    unsigned long rank = (unsigned long) (q * hist->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > hist->count) rank = hist->count;
+
+    unsigned long seen = 0;
+    for (unsigned b = 0; b < MEM_LAT_BUCKETS; ++b)
+    {
+        seen += hist->buckets[b];
+        if (seen >= rank)
+        {
+            unsigned long long high = _mem_lat_bucket_high(b);
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+// capacity: of the node heap and gap index to start with
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, unsigned capacity)
+{
+    // make sure the pool store is allocated
+    if(!pool_store) return NULL;
+
+    // allocate a new memory pool
+    // calloc, so the top gap starts out known-zero (large blocks come
+    // straight from mmap, which is zero already, and aren't cleared again)
+    char* new_mem_pool = calloc(1, size);
+    // check success, on error return null
+    if(!new_mem_pool) return NULL;
+
+    pool_pt pool = _mem_pool_open_on(new_mem_pool, size, policy, MEM_BACKING_HEAP, capacity);
+    if(!pool) free(new_mem_pool);
+
+    return pool;
+}
+
+// set up the mgr and metadata of a pool over memory that is already there;
+// the memory is the caller's to release on failure
+static pool_pt _mem_pool_open_on(char *new_mem_pool, size_t size, alloc_policy policy,
+                                 mem_backing backing, unsigned capacity)
+{
+    // make sure the pool store is allocated
+    if(!pool_store) return NULL;
+
+    // allocate a new mem pool mgr
+    //this is a pointer to a new pool mgr that will be connected to the pool store
+    //calloc so that the stats counters start out zeroed
+    pool_mgr_pt new_mem_pool_mgr = (pool_mgr_pt)_mem_line_calloc(1, sizeof(pool_mgr_t));
+    // check success, on error return null
+    if(!new_mem_pool_mgr) return NULL;
+
+    // allocate a new node heap
+    node_pt new_node_heap = (node_pt)_mem_line_calloc(capacity, sizeof(node_t));
+    // check success, on error deallocate mgr and return null
+    if(!new_node_heap) {
+        free(new_mem_pool_mgr);
+        return NULL;
+    }
+
+    // allocate a new gap index
+    gap_pt new_gap_index = (gap_pt)_mem_line_calloc(1, _mem_gap_ix_bytes(capacity));
+    // check success, on error deallocate mgr/heap and return null
+    if(!new_gap_index)
+    {
+        free(new_node_heap);
+        free(new_mem_pool_mgr);
+        return NULL;
+    }
+
+#ifdef MEM_POOL_LATENCY
+    // allocate the latency histograms
+    new_mem_pool_mgr->latency = (latency_hist_pt)calloc(MEM_LAT_NUM_OPS, sizeof(latency_hist_t));
+    if(!new_mem_pool_mgr->latency)
+    {
+        free(new_gap_index);
+        free(new_node_heap);
+        free(new_mem_pool_mgr);
+        return NULL;
+    }
+#endif
+
+    // assign all the pointers and update meta data
+    new_mem_pool_mgr->backing = backing;
+    new_mem_pool_mgr->map = new_mem_pool;
+    new_mem_pool_mgr->map_size = size;
+    new_mem_pool_mgr->fd = -1;
+    new_mem_pool_mgr->pool.mem = new_mem_pool;
+    new_mem_pool_mgr->node_heap = new_node_heap;
+    new_mem_pool_mgr->total_nodes = capacity;
+    new_mem_pool_mgr->gap_ix = new_gap_index;
+    new_mem_pool_mgr->gap_ix_capacity = capacity;
+    _mem_gap_ix_bind(new_mem_pool_mgr);
+    _mem_pool_init(new_mem_pool_mgr, size, policy);
+
+    //   link pool mgr to pool store
+    if (_mem_pool_register(new_mem_pool_mgr) != ALLOC_OK)
+    {
+#ifdef MEM_POOL_LATENCY
+        free(new_mem_pool_mgr->latency);
+#endif
+        free(new_gap_index);
+        free(new_node_heap);
+        free(new_mem_pool_mgr);
+        return NULL;
+    }
+
+    // return the address of the mgr, cast to (pool_pt)
+
+    return (pool_pt)new_mem_pool_mgr;
+}
+
+// the sub-pool's memory is a single allocation in the parent, which can't
+// close while the sub-pool is open
+static pool_pt _mem_subpool_open(pool_mgr_pt parent, size_t size, alloc_policy policy)
+{
+    if (!parent || size == 0) return NULL;
+
+    char *mem = mem_new_alloc(&parent->pool, size);
+    if (!mem) return NULL;
+
+    pool_pt pool = _mem_pool_open_on(mem, size, policy, MEM_BACKING_SUB, MEM_NODE_HEAP_INIT_CAPACITY);
+    if (!pool)
+    {
+        mem_del_alloc(&parent->pool, mem);
+        return NULL;
+    }
+
+    ((pool_mgr_pt) pool)->parent = parent;
+    _mem_pool_lock(parent);
+    parent->subpools ++;
+    _mem_pool_unlock(parent);
+
+    return pool;
+}
+
+// enough nodes for the expected allocations and gaps without growing, i.e.
+// staying within MEM_NODE_HEAP_FILL_FACTOR; with no hints, the usual start,
+// or for embedded metadata (which can't grow) that of a file-backed pool
+static unsigned _mem_pool_capacity(size_t size, const pool_open_opts_t *opts)
+{
+    if (!opts) return MEM_NODE_HEAP_INIT_CAPACITY;
+
+    if (!opts->expected_allocs && !opts->typical_size && !opts->max_gaps)
+    {
+        if (!(opts->flags & MEM_OPEN_EMBEDDED)) return MEM_NODE_HEAP_INIT_CAPACITY;
+        size_t nodes = size / MEM_FILE_BYTES_PER_NODE + MEM_NODE_HEAP_INIT_CAPACITY;
+        return nodes < MEM_NIL ? (unsigned) nodes : MEM_NIL - 1;
+    }
+
+    unsigned long allocs = opts->expected_allocs;
+    if (!allocs && opts->typical_size) allocs = size / opts->typical_size;
+    // without a bound on gaps, assume every allocation has one after it
+    unsigned long gaps = opts->max_gaps ? opts->max_gaps : allocs + 1;
+
+    double nodes = (double) (allocs + gaps) / MEM_NODE_HEAP_FILL_FACTOR + 1;
+    if (nodes < MEM_NODE_HEAP_INIT_CAPACITY) return MEM_NODE_HEAP_INIT_CAPACITY;
+    if (nodes >= MEM_NIL) return MEM_NIL - 1;
+    return (unsigned) nodes;
+}
+
+// the pool memory is mapped fresh and given a NUMA policy before anything
+// touches it, so the pages are faulted in where the policy says; without
+// NUMA support in the kernel it is an ordinary anonymous mapping
+static pool_pt _mem_pool_open_numa(size_t size, alloc_policy policy, int node)
+{
+    if(!pool_store || size == 0) return NULL;
+    if (node != MEM_NUMA_INTERLEAVE && (node < 0 || node >= MEM_NUMA_MAX_NODES)) return NULL;
+
+    char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[MEM_NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    const unsigned long max_node = MEM_NUMA_MAX_NODES + 1; // the kernel reads max_node - 1 bits
+    int mode = MEM_MPOL_BIND;
+    long result;
+
+    memset(mask, 0, sizeof(mask));
+    if (node == MEM_NUMA_INTERLEAVE)
+    {
+        // over the nodes this thread may use
+        mode = MEM_MPOL_INTERLEAVE;
+        result = syscall(SYS_get_mempolicy, NULL, mask, max_node, NULL, MEM_MPOL_F_MEMS_ALLOWED);
+    }
+    else
+    {
+        mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+        result = 0;
+    }
+    if (result == 0)
+        result = syscall(SYS_mbind, mem, size, mode, mask, max_node, 0);
+
+    // no NUMA in the kernel, or not allowed to set policies: fall back to
+    // the default placement; anything else (e.g. no such node) is an error
+    if (result != 0 && errno != ENOSYS && errno != EPERM)
+    {
+        munmap(mem, size);
+        return NULL;
+    }
+#endif
+
+    pool_pt pool = _mem_pool_open_on(mem, size, policy, MEM_BACKING_ANON, MEM_NODE_HEAP_INIT_CAPACITY);
+    if (!pool) munmap(mem, size);
+
+    return pool;
+}
+
+// the pool memory is a shared mapping of a memfd (zero, like calloc-ed
+// memory), which mem_pool_clone maps again privately instead of copying it
+static pool_pt _mem_pool_open_memfd(size_t size, alloc_policy policy, unsigned capacity)
+{
+    if(!pool_store || size == 0) return NULL;
+
+    int fd = memfd_create("mem_pool", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    char *mem = ftruncate(fd, (off_t) size) == 0 ?
+                mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (mem == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    pool_pt pool = _mem_pool_open_on(mem, size, policy, MEM_BACKING_MEMFD, capacity);
+    if (!pool)
+    {
+        munmap(mem, size);
+        close(fd);
+        return NULL;
+    }
+    ((pool_mgr_pt) pool)->fd = fd;
+
+    return pool;
+}
+
+// the mapping holds, in order: the pool mgr, the node heap, the gap index and
+// the pool memory (line aligned), so a pool is one system allocation with
+// its metadata next to its data; like a file pool's, the metadata is sized
+// up front, and stays untouched (not resident) until nodes are used
+static pool_pt _mem_pool_open_embedded(size_t size, alloc_policy policy, unsigned capacity)
+{
+    // make sure the pool store is allocated
+    if(!pool_store) return NULL;
+    if (size == 0) return NULL;
+
+    size_t node_heap_off = (sizeof(pool_mgr_t) + MEM_CACHE_LINE - 1) & ~(size_t) (MEM_CACHE_LINE - 1);
+    size_t gap_ix_off = node_heap_off + (size_t) capacity * sizeof(node_t);
+    size_t mem_off = (gap_ix_off + _mem_gap_ix_bytes(capacity) + MEM_CACHE_LINE - 1) &
+                     ~(size_t) (MEM_CACHE_LINE - 1);
+    size_t map_size = mem_off + size;
+
+    // zero-filled, which is what the mgr and metadata need to start from
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) map;
+    pool_mgr->backing = MEM_BACKING_EMBEDDED;
+    pool_mgr->map = map;
+    pool_mgr->map_size = map_size;
+    pool_mgr->fd = -1;
+    pool_mgr->node_heap = (node_pt) (map + node_heap_off);
+    pool_mgr->total_nodes = capacity;
+    pool_mgr->gap_ix = (gap_pt) (map + gap_ix_off);
+    pool_mgr->gap_ix_capacity = capacity;
+    pool_mgr->pool.mem = map + mem_off;
+    _mem_gap_ix_bind(pool_mgr);
+
+#ifdef MEM_POOL_LATENCY
+    pool_mgr->latency = (latency_hist_pt)calloc(MEM_LAT_NUM_OPS, sizeof(latency_hist_t));
+    if (!pool_mgr->latency)
+    {
+        munmap(map, map_size);
+        return NULL;
+    }
+#endif
+
+    _mem_pool_init(pool_mgr, size, policy);
+
+    if (_mem_pool_register(pool_mgr) != ALLOC_OK)
+    {
+#ifdef MEM_POOL_LATENCY
+        free(pool_mgr->latency);
+#endif
+        munmap(map, map_size);
+        return NULL;
+    }
+
+    return (pool_pt) pool_mgr;
+}
+
+// the file holds, in order: the header and the pool mgr (first page), the
+// node heap, the gap index, and the pool memory (page aligned); an empty
+// file is laid out and initialized, otherwise the pool in it is reattached
+static pool_pt _mem_pool_open_file(const char *path, size_t size, alloc_policy policy)
+{
+    // make sure the pool store is allocated
+    if(!pool_store) return NULL;
+
+    // no path: an anonymous file; a file this call creates is removed
+    // again if the open fails
+    int made = 0;
+    int fd = -1;
+    if (!path)
+        fd = memfd_create("mem_pool", MFD_CLOEXEC);
+    else if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+        made = 1;
+    else if (errno == EEXIST)
+        fd = open(path, O_RDWR);
+    if (fd < 0) return NULL;
+
+    // one process (and one open) at a time, the metadata has no locking
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+    {
+        close(fd);
+        if (made) unlink(path);
+        return NULL;
+    }
+
+    pool_file_hdr_t hdr;
+    int created = st.st_size == 0;
+
+    if (created)
+    {
+        // new file: lay it out, ftruncate() leaves the metadata sparse
+        // until nodes are actually used
+        if (_mem_file_layout(size, &hdr) != ALLOC_OK ||
+            ftruncate(fd, (off_t) hdr.map_size) != 0) {
+            close(fd);
+            if (made) unlink(path);
+            return NULL;
+        }
+    }
+    else
+    {
+        // existing file: it must be a pool written by this layout
+        if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+            !_mem_file_valid(&hdr, st.st_size))
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    char *map = mmap(NULL, hdr.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        if (made) unlink(path);
+        return NULL;
+    }
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) (map + MEM_FILE_MGR_OFF);
+
+    if (created)
+    {
+        memset(pool_mgr, 0, sizeof(pool_mgr_t));
+        pool_mgr->total_nodes = (unsigned) ((hdr.gap_ix_off - hdr.node_heap_off) / sizeof(node_t));
+        pool_mgr->gap_ix_capacity = pool_mgr->total_nodes;
+    }
+    else if (size && size != pool_mgr->pool.total_size)
+    {
+        // reattaching: size 0 takes whatever the file holds
+        munmap(map, hdr.map_size);
+        close(fd);
+        return NULL;
+    }
+
+    // the pointers are only valid for this mapping, everything else in
+    // the metadata is offsets and indices and needs no fixing up
+    pool_mgr->backing = MEM_BACKING_FILE;
+    pool_mgr->map = map;
+    pool_mgr->map_size = hdr.map_size;
+    pool_mgr->fd = fd;
+    pool_mgr->node_heap = (node_pt) (map + hdr.node_heap_off);
+    pool_mgr->gap_ix = (gap_pt) (map + hdr.gap_ix_off);
+    pool_mgr->pool.mem = map + hdr.mem_off;
+    _mem_gap_ix_bind(pool_mgr);
+
+#ifdef MEM_POOL_LATENCY
+    // histograms are per process, they don't live in the file
+    pool_mgr->latency = (latency_hist_pt)calloc(MEM_LAT_NUM_OPS, sizeof(latency_hist_t));
+    if (!pool_mgr->latency)
+    {
+        munmap(map, hdr.map_size);
+        close(fd);
+        if (made) unlink(path);
+        return NULL;
+    }
+#endif
+
+    if (created) {
+        memcpy(map, &hdr, sizeof(hdr));
+        _mem_pool_init(pool_mgr, size, policy);
+    } else {
+        // whatever sub-pools the last process had are gone with it
+        pool_mgr->id = ++ pool_next_id;
+        pool_mgr->parent = NULL;
+        pool_mgr->subpools = 0;
+    }
+
+    if (_mem_pool_register(pool_mgr) != ALLOC_OK)
+    {
+#ifdef MEM_POOL_LATENCY
+        free(pool_mgr->latency);
+#endif
+        munmap(map, hdr.map_size);
+        close(fd);
+        if (made) unlink(path);
+        return NULL;
+    }
+
+    return (pool_pt) pool_mgr;
+}
+
+// a shared pool has the file layout in a POSIX shared memory object; each
+// process works through its own proxy mgr, which holds the pointers into
+// its mapping and takes the state from the shared mgr under the lock
+static pool_pt _mem_pool_open_shared(const char *name, size_t size, alloc_policy policy)
+{
+    // make sure the pool store is allocated
+    if(!pool_store || !name) return NULL;
+
+    pool_file_hdr_t hdr;
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (fd >= 0)
+    {
+        if (_mem_file_layout(size, &hdr) != ALLOC_OK ||
+            ftruncate(fd, (off_t) hdr.map_size) != 0)
+        {
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+    else
+    {
+        created = 0;
+        if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0) return NULL;
+
+        // the creator may still be setting the pool up, it stores the
+        // magic last
+        struct stat st;
+        unsigned tries = 0;
+        for (;;)
+        {
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(hdr) &&
+                pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr) &&
+                _mem_file_valid(&hdr, st.st_size))
+                break;
+            if (++ tries == MEM_SHARED_ATTACH_TRIES) {
+                close(fd);
+                return NULL;
+            }
+            struct timespec wait = { 0, MEM_SHARED_ATTACH_WAIT_NS };
+            nanosleep(&wait, NULL);
+        }
+        if (size && size != hdr.map_size - hdr.mem_off) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) _mem_line_calloc(1, sizeof(pool_mgr_t));
+    char *map = pool_mgr ?
+                mmap(NULL, hdr.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+#ifdef MEM_POOL_LATENCY
+    if (pool_mgr && map != MAP_FAILED)
+        pool_mgr->latency = (latency_hist_pt)calloc(MEM_LAT_NUM_OPS, sizeof(latency_hist_t));
+    if (pool_mgr && map != MAP_FAILED && !pool_mgr->latency) {
+        munmap(map, hdr.map_size);
+        map = MAP_FAILED;
+    }
+#endif
+    if (map == MAP_FAILED)
+    {
+        free(pool_mgr);
+        close(fd);
+        if (created) shm_unlink(name);
+        return NULL;
+    }
+
+    pool_file_hdr_t *map_hdr = (pool_file_hdr_t *) map;
+
+    pool_mgr->backing = MEM_BACKING_SHARED;
+    pool_mgr->map = map;
+    pool_mgr->map_size = hdr.map_size;
+    pool_mgr->fd = fd;
+    pool_mgr->shared = (pool_mgr_pt) (map + MEM_FILE_MGR_OFF);
+    pool_mgr->node_heap = (node_pt) (map + hdr.node_heap_off);
+    pool_mgr->gap_ix = (gap_pt) (map + hdr.gap_ix_off);
+    pool_mgr->pool.mem = map + hdr.mem_off;
+
+    if (created)
+    {
+        // robust, so that a process dying with the lock held doesn't
+        // wedge the others
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&map_hdr->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        pool_mgr->total_nodes = (unsigned) ((hdr.gap_ix_off - hdr.node_heap_off) / sizeof(node_t));
+        pool_mgr->gap_ix_capacity = pool_mgr->total_nodes;
+        _mem_gap_ix_bind(pool_mgr);
+        _mem_pool_init(pool_mgr, size, policy);
+        _mem_pool_copy_state(pool_mgr->shared, pool_mgr);
+
+        // publish: everything else before the magic
+        map_hdr->version = hdr.version;
+        map_hdr->mgr_size = hdr.mgr_size;
+        map_hdr->gap_ix_layout = hdr.gap_ix_layout;
+        map_hdr->node_heap_off = hdr.node_heap_off;
+        map_hdr->gap_ix_off = hdr.gap_ix_off;
+        map_hdr->mem_off = hdr.mem_off;
+        map_hdr->map_size = hdr.map_size;
+        atomic_thread_fence(memory_order_release);
+        map_hdr->magic = hdr.magic;
+    }
+    else
+    {
+        pool_mgr->id = ++ pool_next_id;
+        _mem_pool_lock(pool_mgr);
+        _mem_gap_ix_bind(pool_mgr);
+        _mem_pool_unlock(pool_mgr);
+    }
+
+    if (_mem_pool_register(pool_mgr) != ALLOC_OK)
+    {
+#ifdef MEM_POOL_LATENCY
+        free(pool_mgr->latency);
+#endif
+        munmap(map, hdr.map_size);
+        close(fd);
+        free(pool_mgr);
+        return NULL;
+    }
+
+    return (pool_pt) pool_mgr;
+}
+
+// the layout of a file or shared pool of the given size; the metadata is
+// sized for the worst case since it can't be reallocated in the mapping
+static alloc_status _mem_file_layout(size_t size, pool_file_hdr_t *hdr)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t total_nodes = size / MEM_FILE_BYTES_PER_NODE + MEM_NODE_HEAP_INIT_CAPACITY;
+
+    if (size == 0 || total_nodes >= MEM_NIL) return ALLOC_FAIL;
+
+    memset(hdr, 0, sizeof(pool_file_hdr_t));
+    hdr->magic = MEM_FILE_MAGIC;
+    hdr->version = MEM_FILE_VERSION;
+    hdr->mgr_size = sizeof(pool_mgr_t);
+    hdr->gap_ix_layout = MEM_FILE_GAP_IX;
+    hdr->node_heap_off = (MEM_FILE_MGR_OFF + sizeof(pool_mgr_t) + 63) & ~(size_t) 63;
+    hdr->gap_ix_off = hdr->node_heap_off + total_nodes * sizeof(node_t);
+    hdr->mem_off = (hdr->gap_ix_off + _mem_gap_ix_bytes((unsigned) total_nodes) + page - 1) & ~(page - 1);
+    hdr->map_size = hdr->mem_off + size;
+
+    return ALLOC_OK;
+}
+
+static int _mem_file_valid(const pool_file_hdr_t *hdr, off_t file_size)
+{
+    return hdr->magic == MEM_FILE_MAGIC && hdr->version == MEM_FILE_VERSION &&
+           hdr->mgr_size == sizeof(pool_mgr_t) && hdr->gap_ix_layout == MEM_FILE_GAP_IX &&
+           hdr->map_size == (uint64_t) file_size;
+}
+
+// copy what a shared pool keeps in the mapping, i.e. everything in the mgr
+// except the per-process pointers
+static void _mem_pool_copy_state(pool_mgr_pt to, const pool_mgr_t *from)
+{
+    char *mem = to->pool.mem;
+
+    to->pool = from->pool;
+    to->pool.mem = mem;
+    to->total_nodes = from->total_nodes;
+    to->used_nodes = from->used_nodes;
+    to->free_node = from->free_node;
+    to->node_top = from->node_top;
+    to->gap_root = from->gap_root;
+    to->gap_addr_root = from->gap_addr_root;
+    to->gap_ix_capacity = from->gap_ix_capacity;
+    to->stats = from->stats;
+    to->adapt = from->adapt;
+    to->search_len = from->search_len;
+    to->resets = from->resets;
+}
+
+// shared pools: take the lock and refresh the proxy from the mapping
+// others: take the pool's own lock, only while maintenance is running
+static void _mem_pool_lock(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->backing != MEM_BACKING_SHARED)
+    {
+        if (atomic_load_explicit(&maint_active, memory_order_relaxed))
+            pthread_mutex_lock(&pool_mgr->maint_lock);
+        return;
+    }
+
+    pthread_mutex_t *lock = &((pool_file_hdr_t *) pool_mgr->map)->lock;
+    // the previous holder died: the metadata is whatever it left behind
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) pthread_mutex_consistent(lock);
+
+    _mem_pool_copy_state(pool_mgr, pool_mgr->shared);
+}
+
+// shared pools: write the proxy back to the mapping and unlock
+static void _mem_pool_unlock(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->backing != MEM_BACKING_SHARED)
+    {
+        if (atomic_load_explicit(&maint_active, memory_order_relaxed))
+            pthread_mutex_unlock(&pool_mgr->maint_lock);
+        return;
+    }
+
+    _mem_pool_copy_state(pool_mgr->shared, pool_mgr);
+
+    pthread_mutex_unlock(&((pool_file_hdr_t *) pool_mgr->map)->lock);
+}
+
+// as _mem_pool_lock, but always locks and gives up if the pool is busy;
+// maintenance takes pool locks under the store lock, which is the reverse
+// of clone and open, so it must not wait
+static int _mem_pool_trylock(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->backing != MEM_BACKING_SHARED)
+        return pthread_mutex_trylock(&pool_mgr->maint_lock) == 0;
+
+    pthread_mutex_t *lock = &((pool_file_hdr_t *) pool_mgr->map)->lock;
+    int result = pthread_mutex_trylock(lock);
+    if (result == EOWNERDEAD) pthread_mutex_consistent(lock);
+    else if (result != 0) return 0;
+
+    _mem_pool_copy_state(pool_mgr, pool_mgr->shared);
+    return 1;
+}
+
+static alloc_status _mem_pool_snapshot(pool_mgr_pt pool_mgr, int fd)
+{
+    pool_pt pool = &pool_mgr->pool;
+    pool_snapshot_hdr_t hdr = { MEM_SNAPSHOT_MAGIC, MEM_SNAPSHOT_VERSION, pool->policy,
+                                pool->total_size, pool_mgr->used_nodes };
+    pool_snapshot_seg_t segs[MEM_SNAPSHOT_SEG_BATCH];
+    unsigned num_segs = 0;
+
+    if (!_mem_write_all(fd, &hdr, sizeof(hdr))) return ALLOC_FAIL;
+
+    // the segment table, batched
+    for (node_pt node = pool_mgr->node_heap; node; node = _mem_node_next(pool_mgr, node))
+    {
+        segs[num_segs].size = node->alloc_record.size;
+        segs[num_segs].allocated = node->allocated;
+        if (++ num_segs == MEM_SNAPSHOT_SEG_BATCH || node->next == MEM_NIL)
+        {
+            if (!_mem_write_all(fd, segs, num_segs * sizeof(pool_snapshot_seg_t))) return ALLOC_FAIL;
+            num_segs = 0;
+        }
+    }
+
+    // the live data, so the snapshot is proportional to alloc_size
+    for (node_pt node = pool_mgr->node_heap; node; node = _mem_node_next(pool_mgr, node))
+    {
+        if (node->allocated &&
+            !_mem_write_all(fd, pool->mem + node->alloc_record.offset, node->alloc_record.size))
+            return ALLOC_FAIL;
+    }
+
+    return ALLOC_OK;
+}
+
+// the restored pool is a heap pool, its metadata is rebuilt directly from
+// the segment table rather than by replaying the allocations
+static pool_pt _mem_pool_restore(int fd)
+{
+    pool_snapshot_hdr_t hdr;
+
+    if (fd < 0 || !_mem_read_all(fd, &hdr, sizeof(hdr)) ||
+        hdr.magic != MEM_SNAPSHOT_MAGIC || hdr.version != MEM_SNAPSHOT_VERSION ||
+        (hdr.policy != FIRST_FIT && hdr.policy != BEST_FIT && hdr.policy != ADAPTIVE) ||
+        hdr.num_segments == 0 || hdr.num_segments >= MEM_NIL)
+        return NULL;
+
+    // make room for all the segments, and as many gaps
+    unsigned num_nodes = (unsigned) hdr.num_segments;
+    unsigned capacity = num_nodes > MEM_NODE_HEAP_INIT_CAPACITY ? num_nodes : MEM_NODE_HEAP_INIT_CAPACITY;
+
+    pool_pt pool = _mem_pool_open((size_t) hdr.total_size, (alloc_policy) hdr.policy, capacity);
+    if (!pool) return NULL;
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // drop the initial gap, the segments replace it
+    _mem_gap_ix_clear(pool_mgr);
+
+    pool_snapshot_seg_t segs[MEM_SNAPSHOT_SEG_BATCH];
+    size_t offset = 0;
+    int ok = 1;
+
+    for (unsigned i = 0; i < num_nodes && ok; ++i)
+    {
+        unsigned batch_ix = i % MEM_SNAPSHOT_SEG_BATCH;
+        if (batch_ix == 0)
+        {
+            unsigned count = num_nodes - i < MEM_SNAPSHOT_SEG_BATCH ?
+                             num_nodes - i : MEM_SNAPSHOT_SEG_BATCH;
+            ok = _mem_read_all(fd, segs, count * sizeof(pool_snapshot_seg_t));
+            if (!ok) break;
+        }
+
+        node_pt node = &pool_mgr->node_heap[i];
+        node->alloc_record.offset = offset;
+        node->alloc_record.size = (size_t) segs[batch_ix].size;
+        node->used = 1;
+        node->allocated = segs[batch_ix].allocated ? 1 : 0;
+        node->zeroed = !node->allocated; // gaps aren't in the snapshot
+        node->prev = i ? i - 1 : MEM_NIL;
+        node->next = i + 1 < num_nodes ? i + 1 : MEM_NIL;
+
+        // the segments must tile the pool
+        ok = node->alloc_record.size && node->alloc_record.size <= hdr.total_size - offset;
+        offset += node->alloc_record.size;
+
+        if (!ok) break;
+        if (node->allocated) {
+            pool->num_allocs ++;
+            pool->alloc_size += node->alloc_record.size;
+            _mem_alloc_ix_insert(pool_mgr, i);
+        } else {
+            ok = _mem_add_to_gap_ix(pool_mgr, node->alloc_record.size, node) == ALLOC_OK;
+        }
+    }
+    ok = ok && offset == hdr.total_size;
+
+    // then the contents of the allocations
+    for (node_pt node = pool_mgr->node_heap; ok && node; node = _mem_node_next(pool_mgr, node))
+    {
+        if (node->allocated)
+            ok = _mem_read_all(fd, pool->mem + node->alloc_record.offset, node->alloc_record.size);
+    }
+
+    pool_mgr->used_nodes = num_nodes;
+    pool_mgr->node_top = num_nodes;
+    pool_mgr->stats.peak_alloc_size = pool->alloc_size;
+
+    if (!ok)
+    {
+        _mem_pool_close(pool_mgr, 1);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// template pools are cloned with a private mapping of their memfd, so only
+// the pages either side writes get copied, see _mem_clone_memfd(); the
+// memory of other pools is copied into an anonymous mapping (that of file
+// and shared pools stays shared with the file, so a mapping of it would
+// show the parent's later writes)
+static pool_pt _mem_pool_clone(pool_mgr_pt parent)
+{
+    pool_pt pool = &parent->pool;
+
+    if(!pool_store) return NULL;
+
+    // only the part of the node heap that has been used needs copying,
+    // the nodes from node_top on have never been touched; the clone's
+    // metadata grows from there like that of any heap pool
+    unsigned high_water = parent->node_top;
+    unsigned capacity = high_water + MEM_NODE_HEAP_INIT_CAPACITY;
+    if (capacity > parent->total_nodes) capacity = parent->total_nodes;
+
+    pool_mgr_pt clone = (pool_mgr_pt) _mem_line_calloc(1, sizeof(pool_mgr_t));
+    if (!clone) return NULL;
+    clone->node_heap = (node_pt) _mem_line_calloc(capacity, sizeof(node_t));
+    clone->gap_ix = (gap_pt) _mem_line_calloc(1, _mem_gap_ix_bytes(capacity));
+#ifdef MEM_POOL_LATENCY
+    clone->latency = (latency_hist_pt) calloc(MEM_LAT_NUM_OPS, sizeof(latency_hist_t));
+    int ok = clone->node_heap && clone->gap_ix && clone->latency;
+#else
+    int ok = clone->node_heap && clone->gap_ix;
+#endif
+
+    char *mem = MAP_FAILED;
+    if (ok && parent->backing == MEM_BACKING_MEMFD)
+        mem = _mem_clone_memfd(parent);
+    else if (ok)
+    {
+        mem = mmap(NULL, pool->total_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) memcpy(mem, pool->mem, pool->total_size);
+    }
+
+    if (mem == MAP_FAILED)
+    {
+#ifdef MEM_POOL_LATENCY
+        free(clone->latency);
+#endif
+        free(clone->gap_ix);
+        free(clone->node_heap);
+        free(clone);
+        return NULL;
+    }
+
+    memcpy(clone->node_heap, parent->node_heap, high_water * sizeof(node_t));
+    clone->pool = *pool;
+    clone->pool.mem = mem;
+    clone->total_nodes = capacity;
+    clone->used_nodes = parent->used_nodes;
+    clone->free_node = parent->free_node;
+    clone->node_top = parent->node_top;
+    clone->gap_ix_capacity = capacity;
+    clone->gap_root = parent->gap_root;
+    clone->gap_addr_root = parent->gap_addr_root;
+    _mem_gap_ix_bind(clone);
+
+    // both index layouts only use entries below the node high water mark
+    memcpy(clone->gap_ix, parent->gap_ix, high_water * sizeof(gap_t));
+#ifndef MEM_POOL_GAP_ARRAY
+    memcpy(clone->gap_tree, parent->gap_tree, high_water * sizeof(gap_link_t));
+    memcpy(clone->gap_addr, parent->gap_addr, high_water * sizeof(gap_addr_link_t));
+#endif
+    _mem_alloc_ix_rebuild(clone);
+    clone->stats = parent->stats;
+    clone->adapt = parent->adapt;
+    clone->search_len = parent->search_len;
+    clone->id = ++ pool_next_id;
+    clone->backing = MEM_BACKING_CLONE;
+    clone->map = mem;
+    clone->map_size = pool->total_size;
+    clone->fd = -1;
+
+    if (_mem_pool_register(clone) != ALLOC_OK)
+    {
+        munmap(mem, pool->total_size);
+#ifdef MEM_POOL_LATENCY
+        free(clone->latency);
+#endif
+        free(clone->gap_ix);
+        free(clone->node_heap);
+        free(clone);
+        return NULL;
+    }
+
+    // the template's memfd must stay as it is while the clone maps it
+    if (parent->backing == MEM_BACKING_MEMFD)
+    {
+        clone->parent = parent;
+        parent->clones ++;
+    }
+
+    return (pool_pt) clone;
+}
+
+// the template is moved to a private mapping of its memfd at its first
+// clone, which leaves the memfd as the pool was then, for good: neither the
+// template nor its clones write to it after that; the pages the template
+// has written since are its own, and copied into later clones
+static char * _mem_clone_memfd(pool_mgr_pt parent)
+{
+    pool_pt pool = &parent->pool;
+    int frozen = parent->frozen;
+
+    if (!frozen)
+    {
+        // same contents, the shared mapping's writes are in the memfd
+        if (mmap(pool->mem, pool->total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 parent->fd, 0) == MAP_FAILED)
+            return MAP_FAILED;
+        parent->frozen = 1;
+    }
+
+    char *mem = mmap(NULL, pool->total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, parent->fd, 0);
+    if (mem != MAP_FAILED && frozen) _mem_copy_written(pool->mem, mem, pool->total_size);
+
+    return mem;
+}
+
+// copy the pages of a private file mapping that this process has written
+// (they are anonymous, the others still read the file) to the same offsets
+// of to; all of them if /proc/self/pagemap can't tell
+static void _mem_copy_written(const char *from, char *to, size_t size)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    uint64_t entries[MEM_PAGEMAP_BATCH];
+
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+    for (size_t first = 0; first < pages; first += MEM_PAGEMAP_BATCH)
+    {
+        size_t n = pages - first < MEM_PAGEMAP_BATCH ? pages - first : MEM_PAGEMAP_BATCH;
+        off_t entry_off = (off_t) (((uintptr_t) from / page + first) * sizeof(uint64_t));
+        int known = fd >= 0 &&
+                    pread(fd, entries, n * sizeof(uint64_t), entry_off) == (ssize_t) (n * sizeof(uint64_t));
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            // an entry has bit 63 set if the page is present, 62 if it is
+            // swapped out, and 61 if it is (still) a page of the file
+            uint64_t entry = entries[i];
+            if (known && (!(entry >> 62 & 3) || entry >> 61 & 1)) continue;
+
+            size_t offset = (first + i) * page;
+            memcpy(to + offset, from + offset, size - offset < page ? size - offset : page);
+        }
+    }
+
+    if (fd >= 0) close(fd);
+}
+
+// zeroed and cache line aligned, released with free()
+static void * _mem_line_calloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size - MEM_CACHE_LINE) return NULL;
+
+    // aligned_alloc wants a whole number of alignments
+    size_t bytes = (count * size + MEM_CACHE_LINE - 1) & ~(size_t) (MEM_CACHE_LINE - 1);
+    void *mem = aligned_alloc(MEM_CACHE_LINE, bytes ? bytes : MEM_CACHE_LINE);
+    if (mem) memset(mem, 0, bytes);
+
+    return mem;
+}
+
+static int _mem_write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 1;
+}
+
+static int _mem_read_all(int fd, void *buf, size_t size)
+{
+    char *p = buf;
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 1;
+}
+
+// initialize a mgr whose pool memory, node heap and gap index are in place
+// to a pool with a single gap
+static void _mem_pool_init(pool_mgr_pt pool_mgr, size_t size, alloc_policy policy)
+{
+    pool_mgr->id = ++ pool_next_id;
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = size;
+    // an ADAPTIVE pool starts out as if bulk loading
+    pool_mgr->stats.active_policy = policy == ADAPTIVE ? FIRST_FIT : policy;
+    pool_mgr->stats.size_classes = 0;
+    pool_mgr->gap_root = MEM_NIL;
+    pool_mgr->gap_addr_root = MEM_NIL;
+    pool_mgr->pool.num_gaps = 0;
+
+    // calloc-ed or freshly mapped, see the callers; the caller's memory,
+    // or the parent's, may hold anything
+    _mem_pool_reset(pool_mgr, pool_mgr->backing != MEM_BACKING_CALLER &&
+                              pool_mgr->backing != MEM_BACKING_SUB);
+}
+
+// make the pool a single gap, with no nodes in use but its head; the gap
+// index and the allocation lookup must be empty already
+// note: nodes from node_top on are taken as they are, like those on the
+//       free list, so the rest of the node heap isn't touched
+static void _mem_pool_reset(pool_mgr_pt pool_mgr, int zeroed)
+{
+    size_t size = pool_mgr->pool.total_size;
+
+    pool_mgr->resets ++;
+    pool_mgr->used_nodes = 1;
+    pool_mgr->free_node = MEM_NIL;
+    pool_mgr->node_top = 1;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_allocs = 0;
+
+    //   initialize top node of node heap
+    node_pt head = pool_mgr->node_heap;
+    head->alloc_record.offset = 0;
+    head->alloc_record.size = size;
+    head->used = 1;
+    head->allocated = 0;
+    head->zeroed = zeroed;
+    head->prev = MEM_NIL;
+    head->next = MEM_NIL;
+
+    //   initialize top node of gap index (_mem_add_to_gap_ix counts it)
+    _mem_add_to_gap_ix(pool_mgr, size, head);
+}
+
+// put what's left of the bump region on the quick lists, in the largest
+// classes that fill it
+static void _mem_fast_scatter(pool_fast_pt fast) {
+    while (fast->end - fast->next >= MEM_FAST_GRAIN)
+    {
+        size_t left = (size_t) (fast->end - fast->next);
+        unsigned c = (unsigned) ((left < MEM_FAST_MAX ? left : MEM_FAST_MAX) / MEM_FAST_GRAIN - 1);
+        memcpy(fast->next, &fast->lists[c], sizeof(void *));
+        fast->lists[c] = fast->next;
+        fast->next += (size_t) (c + 1) * MEM_FAST_GRAIN;
+    }
+}
+
+// the chunks taken by the fast path
+static unsigned long _mem_fast_chunks(pool_mgr_pt pool_mgr) {
+    unsigned long chunks = 0;
+
+    for (char *chunk = pool_mgr->fast.chunks; chunk; ++ chunks)
+        memcpy(&chunk, chunk, sizeof(void *));
+
+    return chunks;
+}
+
+// give the chunks back to the pool, no object may be live
+static void _mem_fast_release(pool_mgr_pt pool_mgr) {
+    pool_fast_pt fast = &pool_mgr->fast;
+
+    for (char *chunk = fast->chunks; chunk; )
+    {
+        char *next;
+        memcpy(&next, chunk, sizeof(void *));
+        _mem_del_alloc(pool_mgr, chunk);
+        chunk = next;
+    }
+
+    memset(fast, 0, sizeof(pool_fast_t));
+    fast->pool = &pool_mgr->pool;
+}
+
+// drop every allocation at once: no coalescing, and the gap index and the
+// allocation lookup are cleared wholesale rather than entry by entry
+static alloc_status _mem_pool_clear(pool_mgr_pt pool_mgr)
+{
+    // sub-pools live in the allocations
+    if (pool_mgr->subpools != 0) return ALLOC_NOT_FREED;
+
+    // nothing allocated, so a single gap already
+    if (pool_mgr->pool.num_allocs == 0) return ALLOC_OK;
+
+    _mem_gap_ix_clear(pool_mgr);
+    // the fast path's chunks went with everything else
+    memset(&pool_mgr->fast, 0, sizeof(pool_fast_t));
+    pool_mgr->fast.pool = &pool_mgr->pool;
+
+    // the allocation lookup is hashed over its whole capacity, which for
+    // metadata sized up front can be far more than the nodes ever used
+    if (pool_mgr->pool.num_allocs < pool_mgr->gap_ix_capacity / MEM_ALLOC_IX_CLEAR_RATIO)
+    {
+        for (unsigned i = 0; i < pool_mgr->node_top; ++i)
+        {
+            node_pt node = &pool_mgr->node_heap[i];
+            if (node->used && node->allocated) _mem_alloc_ix_remove(pool_mgr, node);
+        }
+    }
+    else
+    {
+        memset(pool_mgr->alloc_ix, 0,
+               (size_t) pool_mgr->gap_ix_capacity * MEM_ALLOC_IX_SLOTS * sizeof(unsigned));
+    }
+
+    // what was allocated is dirty, and the gaps aren't worth going through
+    _mem_pool_reset(pool_mgr, 0);
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_pool_register(pool_mgr_pt pool_mgr)
+{
+    pthread_mutex_lock(&pool_store_lock);
+
+    // expand the pool store, if necessary
+    if (((float) pool_store_size / pool_store_capacity) > MEM_POOL_STORE_FILL_FACTOR)
+    {
+        alloc_status result = _mem_resize_pool_store();
+        if(result == ALLOC_FAIL) {
+            pthread_mutex_unlock(&pool_store_lock);
+            return ALLOC_FAIL;
+        }
+    }
+
+    pool_store[pool_store_size++] = pool_mgr;
+    pthread_mutex_init(&pool_mgr->maint_lock, NULL);
+
+    pthread_mutex_unlock(&pool_store_lock);
+
+    return ALLOC_OK;
+}
+
+
+// force: detach the allocations whatever the backing, as if cleared first
+static alloc_status _mem_pool_close(pool_mgr_pt pool_mgr, int force)
+{
+    pool_mgr_pt current_pool_mgr_pt = pool_mgr;
+    pool_pt pool = &pool_mgr->pool;
+
+    // check if this pool is allocated
+    if (!(pool->mem))
+        return ALLOC_NOT_FREED;
+
+    _mem_pool_lock(current_pool_mgr_pt);
+
+    // sub-pools live in this pool's memory, and a template's clones in its memfd
+    if (current_pool_mgr_pt->subpools != 0 || current_pool_mgr_pt->clones != 0)
+    {
+        _mem_pool_unlock(current_pool_mgr_pt);
+        return ALLOC_NOT_FREED;
+    }
+
+    // the fast path's chunks are allocations of the pool's own, which
+    // don't keep it open once no object cut from them is live
+    unsigned long chunks = current_pool_mgr_pt->fast.live == 0 ?
+                           _mem_fast_chunks(current_pool_mgr_pt) : 0;
+
+    // file-backed, shared and cloned pools keep their allocations in a
+    // mapping, so they are detached whatever their state, and sub-pools
+    // go back to their parent with theirs; heap pools (and embedded ones
+    // and those on the caller's memory) must be empty, unless forced
+    if (!force &&
+        (current_pool_mgr_pt->backing == MEM_BACKING_HEAP ||
+        current_pool_mgr_pt->backing == MEM_BACKING_ANON ||
+        current_pool_mgr_pt->backing == MEM_BACKING_MEMFD ||
+        current_pool_mgr_pt->backing == MEM_BACKING_EMBEDDED ||
+        current_pool_mgr_pt->backing == MEM_BACKING_CALLER))
+    {
+        // check if it has zero allocations besides the chunks (then it
+        // is a single gap once they go)
+        if (pool->num_allocs != chunks)
+        {
+            _mem_pool_unlock(current_pool_mgr_pt);
+            return ALLOC_NOT_FREED;
+        }
+    }
+
+    if (chunks) _mem_fast_release(current_pool_mgr_pt);
+    _mem_pool_unlock(current_pool_mgr_pt);
+
+    // find mgr in pool store and set to null
+    // note: under the store lock, so a maintenance pass is done with it
+    pthread_mutex_lock(&pool_store_lock);
+    for (int index = 0; index < pool_store_size; ++index)
+    {
+        if (pool_store[index] == current_pool_mgr_pt)
+        {
+            pool_store[index] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_store_lock);
+    pthread_mutex_destroy(&current_pool_mgr_pt->maint_lock);
+    // note: don't decrement pool_store_size, because it only grows
+
+#ifdef MEM_POOL_LATENCY
+    free(current_pool_mgr_pt->latency);
+#endif
+
+    if (current_pool_mgr_pt->backing == MEM_BACKING_EMBEDDED)
+    {
+        // the mgr is inside the mapping
+        if (munmap(current_pool_mgr_pt->map, current_pool_mgr_pt->map_size) != 0) perror("munmap");
+        return ALLOC_OK;
+    }
+
+    if (current_pool_mgr_pt->backing == MEM_BACKING_CLONE)
+    {
+        pool_mgr_pt parent = current_pool_mgr_pt->parent;
+        munmap(current_pool_mgr_pt->map, current_pool_mgr_pt->map_size);
+        free(current_pool_mgr_pt->node_heap);
+        free(current_pool_mgr_pt->gap_ix);
+        free(current_pool_mgr_pt);
+        if (parent)
+        {
+            _mem_pool_lock(parent);
+            parent->clones --;
+            _mem_pool_unlock(parent);
+        }
+        return ALLOC_OK;
+    }
+
+    if (current_pool_mgr_pt->backing == MEM_BACKING_FILE ||
+        current_pool_mgr_pt->backing == MEM_BACKING_SHARED)
+    {
+        // a file mgr is inside the mapping, so the mapping goes last
+        int fd = current_pool_mgr_pt->fd;
+        int shared = current_pool_mgr_pt->backing == MEM_BACKING_SHARED;
+        if (munmap(current_pool_mgr_pt->map, current_pool_mgr_pt->map_size) != 0) perror("munmap");
+        close(fd); // also drops the flock of a file
+        if (shared) free(current_pool_mgr_pt);
+        return ALLOC_OK;
+    }
+
+    // free memory pool (the caller's stays with the caller)
+    if (current_pool_mgr_pt->backing == MEM_BACKING_ANON)
+        munmap(current_pool_mgr_pt->map, current_pool_mgr_pt->map_size);
+    else if (current_pool_mgr_pt->backing == MEM_BACKING_MEMFD)
+    {
+        munmap(current_pool_mgr_pt->map, current_pool_mgr_pt->map_size);
+        close(current_pool_mgr_pt->fd);
+    }
+    else if (current_pool_mgr_pt->backing == MEM_BACKING_HEAP)
+        free(pool->mem);
+    else if (current_pool_mgr_pt->backing == MEM_BACKING_SUB)
+    {
+        pool_mgr_pt parent = current_pool_mgr_pt->parent;
+        mem_del_alloc(&parent->pool, pool->mem);
+        _mem_pool_lock(parent);
+        parent->subpools --;
+        _mem_pool_unlock(parent);
+    }
+    // free node heap
+    free(current_pool_mgr_pt->node_heap);
+    // free gap index
+    free(current_pool_mgr_pt->gap_ix);
+
+    // free mgr
+    free(current_pool_mgr_pt);
+
+    return ALLOC_OK;
+}
+
+// zero: clear the allocation, unless the gap it comes from is known-zero
+static void * _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size, int zero) {
+    pool_mgr_pt current_pool_mgr_pt = pool_mgr;
+    pool_pt pool = &pool_mgr->pool;
+
+    // check if any gaps, return null if none
+    if (pool->num_gaps == 0 || size == 0) {
+        current_pool_mgr_pt->stats.fail_count ++;
+        return NULL;
+    }
+
+    // expand heap node, if necessary, quit on error
+    alloc_status result = _mem_resize_node_heap(current_pool_mgr_pt);
+    if (result != ALLOC_OK) {
+        current_pool_mgr_pt->stats.fail_count ++;
+        return NULL;
+    }
+
+    // check used nodes fewer than total nodes, quit on error
+    if (current_pool_mgr_pt->used_nodes >= current_pool_mgr_pt->total_nodes) {
+        current_pool_mgr_pt->stats.fail_count ++;
+        return NULL;
+    }
+
+    // get a node for allocation:
+    node_pt alloc_node = NULL;
+    unsigned search_len = 0;
+
+    MEM_LAT_BEGIN(search_start);
+
+    assert((pool->policy == FIRST_FIT) || (pool->policy == BEST_FIT) || (pool->policy == ADAPTIVE));
+    // ADAPTIVE pools place as decided last, the index serves both ways
+    size_t request = size;
+    if (current_pool_mgr_pt->stats.size_classes) request = _mem_size_class(size);
+
+    if (current_pool_mgr_pt->stats.active_policy == FIRST_FIT)
+    {
+        // if FIRST_FIT, then find the sufficient gap with the lowest offset
+        alloc_node = _mem_gap_ix_first_fit(current_pool_mgr_pt, request, &search_len);
+    }
+    else
+    {
+        // if BEST_FIT, then find the first sufficient node in the gap index
+        alloc_node = _mem_gap_ix_lower_bound(current_pool_mgr_pt, request, &search_len);
+        // a size class that doesn't fit anywhere may still fit as it is
+        if (!alloc_node && request != size)
+        {
+            request = size;
+            alloc_node = _mem_gap_ix_lower_bound(current_pool_mgr_pt, request, &search_len);
+        }
+    }
+    MEM_LAT_END(current_pool_mgr_pt, MEM_LAT_SEARCH, search_start);
+    current_pool_mgr_pt->search_len += search_len;
+    if (pool->policy == ADAPTIVE) _mem_adapt_sample(current_pool_mgr_pt, size, search_len);
+    // from here on, the size of the block taken
+    size = request;
+
+    // check if node found
+    if (!alloc_node) {
+        current_pool_mgr_pt->stats.fail_count ++;
+        return NULL;
+    }
+
+    // update metadata (num_allocs, alloc_size)
+    pool->num_allocs += 1;
+    pool->alloc_size += size;
+    current_pool_mgr_pt->stats.alloc_count ++;
+    if (pool->alloc_size > current_pool_mgr_pt->stats.peak_alloc_size)
+        current_pool_mgr_pt->stats.peak_alloc_size = pool->alloc_size;
+
+    // calculate the size of the remaining gap, if any
+    size_t remaining = alloc_node->alloc_record.size - size;
+    // the remaining gap is as clean as the whole one was
+    unsigned zeroed = alloc_node->zeroed;
+
+    // remove node from gap index
+    result = _mem_remove_from_gap_ix(current_pool_mgr_pt,
+                                     alloc_node->alloc_record.size,
+                                     alloc_node);
+    assert(result == ALLOC_OK);
+
+    // convert gap_node to an allocation node of given size
+    alloc_node->allocated = 1;
+    alloc_node->zeroed = 0;
+    alloc_node->alloc_record.size = size;
+    _mem_alloc_ix_insert(current_pool_mgr_pt, (unsigned) (alloc_node - current_pool_mgr_pt->node_heap));
+
+    // adjust node heap:
+    if (remaining)
+    {
+        //   if remaining gap, need a new node
+        //   take an unused one from the node heap
+        unsigned gap_node_ix = _mem_node_get(current_pool_mgr_pt);
+        //   make sure one was found
+        assert(gap_node_ix != MEM_NIL);
+        node_pt gap_node = &current_pool_mgr_pt->node_heap[gap_node_ix];
+        unsigned alloc_ix = (unsigned) (alloc_node - current_pool_mgr_pt->node_heap);
+
+        //   initialize it to a gap node
+        gap_node->alloc_record.offset = alloc_node->alloc_record.offset + size;
+        gap_node->alloc_record.size = remaining;
+        gap_node->used = 1;
+        gap_node->allocated = 0;
+        gap_node->zeroed = zeroed;
+
+        //   update metadata (used_nodes)
+        current_pool_mgr_pt->used_nodes ++;
+
+        //   update linked list (new node right after the node for allocation)
+        gap_node->prev = alloc_ix;
+        gap_node->next = alloc_node->next;
+        if (alloc_node->next != MEM_NIL) current_pool_mgr_pt->node_heap[alloc_node->next].prev = gap_node_ix;
+        alloc_node->next = gap_node_ix;
+
+        //   add to gap index
+        result = _mem_add_to_gap_ix(current_pool_mgr_pt, remaining, gap_node);
+        //   check if successful
+        assert(result == ALLOC_OK);
+
+        current_pool_mgr_pt->stats.split_count ++;
+    }
+
+    if (zero && zeroed) {
+        current_pool_mgr_pt->stats.zero_skip_count ++;
+    } else if (zero) {
+        _mem_zero(pool->mem + alloc_node->alloc_record.offset, size);
+        current_pool_mgr_pt->stats.zero_fill_count ++;
+    }
+
+    // return the allocation's memory, which is what mem_del_alloc receives
+    return pool->mem + alloc_node->alloc_record.offset;
+}
+
+// memset for small blocks; large ones are cleared with non-temporal stores,
+// which don't pull the block into the cache only to evict what's there
+static void _mem_zero(char *mem, size_t size) {
+#ifdef __SSE2__
+    if (size >= MEM_ZERO_STREAM_MIN)
+    {
+        // memset up to a line boundary, stream whole lines, memset the rest
+        size_t head = (MEM_CACHE_LINE - (uintptr_t) mem % MEM_CACHE_LINE) % MEM_CACHE_LINE;
+        memset(mem, 0, head);
+        mem += head;
+        size -= head;
+
+        __m128i zero = _mm_setzero_si128();
+        char *end = mem + size / MEM_CACHE_LINE * MEM_CACHE_LINE;
+        for (; mem < end; mem += MEM_CACHE_LINE)
+        {
+            _mm_stream_si128((__m128i *) mem, zero);
+            _mm_stream_si128((__m128i *) (mem + 16), zero);
+            _mm_stream_si128((__m128i *) (mem + 32), zero);
+            _mm_stream_si128((__m128i *) (mem + 48), zero);
+        }
+        _mm_sfence();
+        size %= MEM_CACHE_LINE;
+    }
+#endif
+    memset(mem, 0, size);
+}
+
+static void * _mem_maint_main(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&maint_mutex);
+    while (!maint_stop)
+    {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += maint_interval_ms / 1000;
+        until.tv_nsec += (long) (maint_interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec ++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&maint_cond, &maint_mutex, &until);
+        if (maint_stop) break;
+
+        pthread_mutex_unlock(&maint_mutex);
+        _mem_maint_pass();
+        pthread_mutex_lock(&maint_mutex);
+    }
+    pthread_mutex_unlock(&maint_mutex);
+
+    return NULL;
+}
+
+// every open pool, a few gaps per lock hold so that allocations get in
+// between; a busy pool is left for the next pass, which resumes where
+// this one stopped
+static void _mem_maint_pass() {
+    pthread_mutex_lock(&pool_store_lock);
+    for (unsigned i = 0; i < pool_store_size; ++i)
+    {
+        pool_mgr_pt pool_mgr = pool_store[i];
+        size_t budget = MEM_MAINT_ZERO_BUDGET;
+        int more = 1;
+
+        while (more && pool_mgr && _mem_pool_trylock(pool_mgr))
+        {
+            more = _mem_pool_maintain(pool_mgr, &budget);
+
+            // _mem_pool_unlock only unlocks non-shared pools while maintenance runs
+            if (pool_mgr->backing == MEM_BACKING_SHARED)
+                _mem_pool_unlock(pool_mgr);
+            else
+                pthread_mutex_unlock(&pool_mgr->maint_lock);
+            if (more) sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&pool_store_lock);
+}
+
+// one lock hold of a pass: walks the gaps in address order from where the
+// last hold stopped, and leaves them known-zero, large ones by giving their
+// pages back to the OS (they read as zero afterwards), small ones by
+// clearing them out of the budget; a gap is worked on MEM_MAINT_HOLD_BYTES
+// at a time, and picked up again by the next hold if the pool hasn't
+// changed in between; 0 once the walk is through the pool
+// note: coalescing isn't deferred here, mem_del_alloc keeps the gaps
+//       merged, which the pool_t counters and mem_inspect_pool rely on
+static int _mem_pool_maintain(pool_mgr_pt pool_mgr, size_t *budget) {
+    char *mem = pool_mgr->pool.mem;
+    unsigned long changes = _mem_pool_changes(pool_mgr);
+    size_t bytes = MEM_MAINT_HOLD_BYTES;
+
+    // a gap worked on before is only the same if nothing happened since
+    if (changes != pool_mgr->maint_changes) pool_mgr->maint_done = 0;
+    pool_mgr->maint_changes = changes;
+
+    for (unsigned gaps = 0; gaps < MEM_MAINT_HOLD_GAPS && bytes; ++gaps)
+    {
+        node_pt node = _mem_gap_ix_next(pool_mgr, pool_mgr->maint_offset);
+        if (!node)
+        {
+            pool_mgr->maint_offset = 0;
+            pool_mgr->maint_done = 0;
+            return 0;
+        }
+
+        size_t offset = node->alloc_record.offset;
+        size_t size = node->alloc_record.size;
+        size_t done = offset == pool_mgr->maint_offset ? pool_mgr->maint_done : 0;
+        int release = size >= MEM_MAINT_RELEASE_MIN && _mem_gap_releasable(pool_mgr);
+
+        pool_mgr->maint_offset = offset;
+        pool_mgr->maint_done = 0;
+        if (node->zeroed || (!release && !done && size > *budget))
+        {
+            pool_mgr->maint_offset = offset + size;
+            continue;
+        }
+        if (!release && !done) *budget -= size;
+
+        // steps end on a page boundary, so no page is cleared by hand twice
+        size_t step = size - done <= bytes ? size - done : bytes;
+        char *start = mem + offset + done;
+        char *end = start + step;
+        if (done + step < size)
+        {
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            char *aligned = (char *) ((uintptr_t) end & ~(uintptr_t) (page - 1));
+            if (aligned > start) end = aligned;
+        }
+        _mem_gap_clean(pool_mgr, start, end, release);
+        bytes -= (size_t) (end - start);
+        done += (size_t) (end - start);
+
+        if (done < size)
+        {
+            pool_mgr->maint_done = done;
+            return 1;
+        }
+        node->zeroed = 1;
+        pool_mgr->maint_offset = offset + size;
+    }
+
+    return 1;
+}
+
+// changes with every allocation, deallocation and clear of the pool
+static unsigned long _mem_pool_changes(pool_mgr_pt pool_mgr) {
+    return pool_mgr->stats.alloc_count + pool_mgr->stats.free_count + pool_mgr->resets;
+}
+
+// 0 if the backing can't release pages (a clone may be a private mapping of
+// a memfd, whose pages would read back as the memfd, a template's memfd is
+// mapped by its clones while it has any, the caller's memory may be
+// anything, e.g. pinned for DMA, and a sub-pool's is its parent's to
+// release)
+static int _mem_gap_releasable(pool_mgr_pt pool_mgr) {
+    return pool_mgr->backing != MEM_BACKING_CLONE && pool_mgr->backing != MEM_BACKING_CALLER &&
+           pool_mgr->backing != MEM_BACKING_SUB && pool_mgr->clones == 0;
+}
+
+// leave [start, end) of a gap zero: with release, its whole pages are given
+// back to the OS and only the partial ones at either end are cleared by
+// hand, otherwise (or if there's no whole page, or the OS refuses) all of it
+static void _mem_gap_clean(pool_mgr_pt pool_mgr, char *start, char *end, int release) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *first = (char *) (((uintptr_t) start + page - 1) & ~(uintptr_t) (page - 1));
+    char *last = (char *) ((uintptr_t) end & ~(uintptr_t) (page - 1));
+
+    int released = 0;
+    if (release && last > first)
+    {
+        if (pool_mgr->backing == MEM_BACKING_FILE || pool_mgr->backing == MEM_BACKING_SHARED ||
+            pool_mgr->backing == MEM_BACKING_MEMFD)
+        {
+            // the mapping covers the file from offset 0, punching a hole frees
+            // the blocks (or shm or memfd pages) and leaves zeros
+            off_t file_off = (off_t) (first - (char *) pool_mgr->map);
+            released = fallocate(pool_mgr->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                 file_off, (off_t) (last - first)) == 0;
+            // a frozen template's own copies of the pages go too, so that
+            // it reads the hole
+            if (released && pool_mgr->frozen)
+                released = madvise(first, (size_t) (last - first), MADV_DONTNEED) == 0;
+        }
+        else
+        {
+            // private anonymous pages (heap pools' big blocks are mmap-ed too)
+            released = madvise(first, (size_t) (last - first), MADV_DONTNEED) == 0;
+        }
+    }
+
+    if (released)
+    {
+        memset(start, 0, (size_t) (first - start));
+        memset(last, 0, (size_t) (end - last));
+        pool_mgr->stats.released_size += (size_t) (last - first);
+    }
+    else
+    {
+        _mem_zero(start, (size_t) (end - start));
+        pool_mgr->stats.prezeroed_size += (size_t) (end - start);
+    }
+}
+
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, void * alloc) {
+    pool_mgr_pt current_pool_mgr_pt = pool_mgr;
+    pool_pt pool = &pool_mgr->pool;
+    alloc_status result;
+
+    // the allocation must be inside the pool
+    if ((char *) alloc < pool->mem || (char *) alloc >= pool->mem + pool->total_size)
+        return ALLOC_FAIL;
+    size_t offset = (size_t) ((char *) alloc - pool->mem);
+
+    // find the node in the node heap
+    // this is node-to-delete
+    node_pt node_to_del = _mem_alloc_ix_find(current_pool_mgr_pt, offset);
+    // make sure it's found
+    if (!node_to_del) return ALLOC_FAIL;
+    _mem_alloc_ix_remove(current_pool_mgr_pt, node_to_del);
+
+    // convert to gap node, the allocation has been written to
+    node_to_del->allocated = 0;
+    node_to_del->zeroed = 0;
+    // update metadata (num_allocs, alloc_size)
+    pool->num_allocs --;
+    pool->alloc_size -= node_to_del->alloc_record.size;
+    current_pool_mgr_pt->stats.free_count ++;
+    if (pool->policy == ADAPTIVE) current_pool_mgr_pt->adapt.frees ++;
+
+    // if the next node in the list is also a gap, merge into node-to-delete
+    node_pt next = _mem_node_next(current_pool_mgr_pt, node_to_del);
+    if (next && !next->allocated)
+    {
+        //   remove the next node from gap index
+        result = _mem_remove_from_gap_ix(current_pool_mgr_pt, next->alloc_record.size, next);
+        //   check success
+        if (result != ALLOC_OK) return result;
+        //   add the size to the node-to-delete
+        node_to_del->alloc_record.size += next->alloc_record.size;
+        //   update linked list:
+        node_to_del->next = next->next;
+        if (next->next != MEM_NIL)
+            current_pool_mgr_pt->node_heap[next->next].prev = next->prev;
+        //   update node as unused (and metadata)
+        _mem_node_put(current_pool_mgr_pt, next);
+
+        current_pool_mgr_pt->stats.coalesce_count ++;
+    }
+
+    // this merged node-to-delete might need to be added to the gap index
+    // but one more thing to check...
+    // if the previous node in the list is also a gap, merge into previous!
+    node_pt prev = _mem_node_prev(current_pool_mgr_pt, node_to_del);
+    if (prev && !prev->allocated)
+    {
+        //   remove the previous node from gap index
+        result = _mem_remove_from_gap_ix(current_pool_mgr_pt, prev->alloc_record.size, prev);
+        //   check success
+        if (result != ALLOC_OK) return result;
+        //   add the size of node-to-delete to the previous
+        prev->alloc_record.size += node_to_del->alloc_record.size;
+        prev->zeroed = 0;
+        //   update linked list
+        prev->next = node_to_del->next;
+        if (node_to_del->next != MEM_NIL)
+            current_pool_mgr_pt->node_heap[node_to_del->next].prev = node_to_del->prev;
+        //   update node-to-delete as unused (and metadata)
+        _mem_node_put(current_pool_mgr_pt, node_to_del);
+
+        //   change the node to add to the previous node!
+        node_to_del = prev;
+
+        current_pool_mgr_pt->stats.coalesce_count ++;
+    }
+
+    // add the resulting node to the gap index
+    result = _mem_add_to_gap_ix(current_pool_mgr_pt,
+                                node_to_del->alloc_record.size,
+                                node_to_del);
+    // check success
+    return result;
+}
+
+// list neighbours of a node, NULL at the ends
+static node_pt _mem_node_next(pool_mgr_pt pool_mgr, node_pt node) {
+    return node->next == MEM_NIL ? NULL : &pool_mgr->node_heap[node->next];
+}
+
+static node_pt _mem_node_prev(pool_mgr_pt pool_mgr, node_pt node) {
+    return node->prev == MEM_NIL ? NULL : &pool_mgr->node_heap[node->prev];
+}
+
+static alloc_status _mem_resize_pool_store() {
+
+    // ALLOCATE NEW POOL STORE OF CAPACITY: (pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR)
+    unsigned new_capacity = pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR;
+    pool_mgr_pt* new_pool_store =
+            (pool_mgr_pt*) realloc(pool_store, new_capacity * sizeof(pool_mgr_pt));
+    if(!new_pool_store) return ALLOC_FAIL;
+
+    // NULL OUT THE NEW SLOTS, THE OLD ONES WERE MOVED BY realloc()
+    for(unsigned i = pool_store_capacity; i < new_capacity; ++i)
+    {
+        new_pool_store[i] = NULL;
+    }
+    pool_store_capacity = new_capacity;
+    pool_store = new_pool_store;
+
+    return ALLOC_OK;
+}
+
+// grows the node heap by MEM_NODE_HEAP_EXPAND_FACTOR once it is more than
+// MEM_NODE_HEAP_FILL_FACTOR full, the gap index along with it; nodes link by
+// index, so they are copied as they are, and the cost is amortized O(1)
+// note: file-backed, shared and embedded pools have their metadata sized
+//       up front
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
+    if ((float) pool_mgr->used_nodes / pool_mgr->total_nodes <= MEM_NODE_HEAP_FILL_FACTOR)
+        return ALLOC_OK;
+    if (pool_mgr->backing == MEM_BACKING_FILE || pool_mgr->backing == MEM_BACKING_SHARED ||
+        pool_mgr->backing == MEM_BACKING_EMBEDDED)
+        return ALLOC_OK;
+
+    unsigned long new_total = (unsigned long) pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
+    if (new_total >= MEM_NIL) new_total = MEM_NIL - 1;
+    if (new_total <= pool_mgr->total_nodes) return ALLOC_OK;
+
+    // the gap index first, it may be larger than the node heap but not smaller
+    if (_mem_gap_ix_grow(pool_mgr, (unsigned) new_total) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    node_pt node_heap = (node_pt) _mem_line_calloc(new_total, sizeof(node_t));
+    if (!node_heap) return ALLOC_FAIL;
+
+    // only the nodes below node_top have ever been written
+    memcpy(node_heap, pool_mgr->node_heap, pool_mgr->node_top * sizeof(node_t));
+    free(pool_mgr->node_heap);
+    pool_mgr->node_heap = node_heap;
+    pool_mgr->total_nodes = (unsigned) new_total;
+    pool_mgr->stats.resize_count ++;
+
+    return ALLOC_OK;
+}
+
+// the gap index grows with the node heap (an entry per node), so all there
+// is to do here is catch up, should it be behind
+static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->gap_ix_capacity >= pool_mgr->total_nodes)
+        return ALLOC_OK;
+
+    return _mem_gap_ix_grow(pool_mgr, pool_mgr->total_nodes);
+}
+
+/*
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
+                                       size_t size,
+                                       node_pt node) {
+
+    // expand the gap index, if necessary (call the function)
+    // add the entry at the end
+    // update metadata (num_gaps)
+    // sort the gap index (call the function)
+    // check success
+
+    return ALLOC_FAIL;
+}
+*/
+
+
+// THIS CODE PROVIDED BY INSTRUCTOR
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node)
+{
+    MEM_LAT_BEGIN(start);
+
+    // resize the gap index, if necessary
+    alloc_status result = _mem_resize_gap_ix(pool_mgr);
+    assert(result == ALLOC_OK);
+    if (result != ALLOC_OK) return ALLOC_FAIL;
+
+#ifdef MEM_POOL_GAP_ARRAY
+    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
+    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = (unsigned) (node - pool_mgr->node_heap);
+    pool_mgr->pool.num_gaps ++;
+    pool_mgr->stats.gap_hist[_mem_gap_hist_bucket(size)] ++;
+
+    // sort the gap index after addition
+    result = _mem_sort_gap_ix(pool_mgr);
+    assert(result == ALLOC_OK);
+    if (result != ALLOC_OK) return ALLOC_FAIL;
+#else
+    // the entry of a node is at the node's index
+    unsigned gap = (unsigned) (node - pool_mgr->node_heap);
+    assert(pool_mgr->gap_ix[gap].size == 0);
+
+    pool_mgr->gap_ix[gap].size = size;
+    pool_mgr->gap_ix[gap].node = gap;
+    pool_mgr->gap_tree[gap].left = MEM_NIL;
+    pool_mgr->gap_tree[gap].right = MEM_NIL;
+    pool_mgr->gap_root = _mem_gap_tree_insert(pool_mgr, pool_mgr->gap_root, gap);
+    pool_mgr->gap_addr[gap].max = size;
+    pool_mgr->gap_addr[gap].left = MEM_NIL;
+    pool_mgr->gap_addr[gap].right = MEM_NIL;
+    pool_mgr->gap_addr_root = _mem_gap_addr_insert(pool_mgr, pool_mgr->gap_addr_root, gap);
+    pool_mgr->pool.num_gaps ++;
+    pool_mgr->stats.gap_hist[_mem_gap_hist_bucket(size)] ++;
+#endif
+
+    MEM_LAT_END(pool_mgr, MEM_LAT_INDEX, start);
+
+    return result;
+}
+
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
+                                            size_t size,
+                                            node_pt node) {
+    MEM_LAT_BEGIN(start);
+
+    unsigned node_ix = (unsigned) (node - pool_mgr->node_heap);
+
+#ifdef MEM_POOL_GAP_ARRAY
+    // find the position of the node in the gap index
+    unsigned position = 0;
+    while (position < pool_mgr->pool.num_gaps && pool_mgr->gap_ix[position].node != node_ix)
+        ++ position;
+    if (position == pool_mgr->pool.num_gaps) return ALLOC_FAIL;
+
+    // loop from there to the end of the array:
+    //    pull the entries (i.e. copy over) one position up
+    //    this effectively deletes the chosen node
+    for (unsigned i = position; i + 1 < pool_mgr->pool.num_gaps; ++i)
+        pool_mgr->gap_ix[i] = pool_mgr->gap_ix[i + 1];
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps --;
+    pool_mgr->stats.gap_hist[_mem_gap_hist_bucket(size)] --;
+
+    // zero out the element at position num_gaps!
+    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = 0;
+    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = MEM_NIL;
+#else
+    // unlinked by its (size, offset) key, which hasn't changed since it
+    // was added, then marked as not in the index
+    if (node_ix >= pool_mgr->gap_ix_capacity || pool_mgr->gap_ix[node_ix].size == 0)
+        return ALLOC_FAIL;
+
+    pool_mgr->gap_root = _mem_gap_tree_remove(pool_mgr, pool_mgr->gap_root, node_ix);
+    pool_mgr->gap_addr_root = _mem_gap_addr_remove(pool_mgr, pool_mgr->gap_addr_root, node_ix);
+    pool_mgr->gap_ix[node_ix].size = 0;
+    pool_mgr->gap_ix[node_ix].node = MEM_NIL;
+
+    pool_mgr->pool.num_gaps --;
+    pool_mgr->stats.gap_hist[_mem_gap_hist_bucket(size)] --;
+#endif
+
+    MEM_LAT_END(pool_mgr, MEM_LAT_INDEX, start);
+
+    return ALLOC_OK;
+}
+
+// note: only called by _mem_add_to_gap_ix, which appends a single entry
+static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
+#ifdef MEM_POOL_GAP_ARRAY
+    // the new entry is at the end, so "bubble it up"
+    // loop from num_gaps - 1 until but not including 0:
+    //    if the size of the current entry is less than the previous (u - 1)
+    //    or if the sizes are the same but the current entry points to a
+    //    node with a lower address of pool allocation address (mem)
+    //       swap them (by copying) (remember to use a temporary variable)
+    gap_pt gap_ix = pool_mgr->gap_ix;
+    node_pt node_heap = pool_mgr->node_heap;
+    for (unsigned u = pool_mgr->pool.num_gaps - 1; u > 0; --u)
+    {
+        if (gap_ix[u].size < gap_ix[u - 1].size ||
+            (gap_ix[u].size == gap_ix[u - 1].size &&
+             node_heap[gap_ix[u].node].alloc_record.offset <
+             node_heap[gap_ix[u - 1].node].alloc_record.offset))
+        {
+            gap_t temp = gap_ix[u];
+            gap_ix[u] = gap_ix[u - 1];
+            gap_ix[u - 1] = temp;
+        }
+        else break;
+    }
+#endif
+
+    return ALLOC_OK;
+}
+
+// the smallest gap of at least size, lowest offset among equals
+static node_pt _mem_gap_ix_lower_bound(pool_mgr_pt pool_mgr, size_t size, unsigned *search_len) {
+    gap_pt gap_ix = pool_mgr->gap_ix;
+
+#ifdef MEM_POOL_GAP_ARRAY
+    for (unsigned i = 0; i < pool_mgr->pool.num_gaps; ++i)
+    {
+        ++ *search_len;
+        if (gap_ix[i].size >= size) return &pool_mgr->node_heap[gap_ix[i].node];
+    }
+    return NULL;
+#else
+    unsigned found = MEM_NIL;
+    for (unsigned u = pool_mgr->gap_root; u != MEM_NIL; )
+    {
+        ++ *search_len;
+        if (gap_ix[u].size >= size) {
+            found = u;
+            u = pool_mgr->gap_tree[u].left;
+        } else {
+            u = pool_mgr->gap_tree[u].right;
+        }
+    }
+    return found == MEM_NIL ? NULL : &pool_mgr->node_heap[found];
+#endif
+}
+
+// the sufficient gap with the lowest offset
+static node_pt _mem_gap_ix_first_fit(pool_mgr_pt pool_mgr, size_t size, unsigned *search_len) {
+#ifdef MEM_POOL_GAP_ARRAY
+    // walk the node heap list, allocations included
+    for (node_pt node = pool_mgr->node_heap; node; node = _mem_node_next(pool_mgr, node))
+    {
+        ++ *search_len;
+        if (!node->allocated && node->alloc_record.size >= size) return node;
+    }
+    return NULL;
+#else
+    // go left whenever the left subtree has a gap that fits, otherwise
+    // take this gap if it fits, otherwise the right subtree must have one
+    gap_addr_link_pt addr = pool_mgr->gap_addr;
+    unsigned u = pool_mgr->gap_addr_root;
+
+    if (u == MEM_NIL || addr[u].max < size) return NULL;
+    for (;;)
+    {
+        ++ *search_len;
+        unsigned left = addr[u].left;
+        if (left != MEM_NIL && addr[left].max >= size)
+            u = left;
+        else if (pool_mgr->gap_ix[u].size >= size)
+            return &pool_mgr->node_heap[u];
+        else
+            u = addr[u].right;
+    }
+#endif
+}
+
+// the gap with the lowest offset at or after offset, NULL if there is none
+static node_pt _mem_gap_ix_next(pool_mgr_pt pool_mgr, size_t offset) {
+#ifdef MEM_POOL_GAP_ARRAY
+    // the array is by size, so every gap is looked at
+    node_pt found = NULL;
+    for (unsigned i = 0; i < pool_mgr->pool.num_gaps; ++i)
+    {
+        node_pt node = &pool_mgr->node_heap[pool_mgr->gap_ix[i].node];
+        if (node->alloc_record.offset >= offset &&
+            (!found || node->alloc_record.offset < found->alloc_record.offset))
+            found = node;
+    }
+    return found;
+#else
+    gap_addr_link_pt addr = pool_mgr->gap_addr;
+    unsigned found = MEM_NIL;
+
+    for (unsigned u = pool_mgr->gap_addr_root; u != MEM_NIL; )
+    {
+        if (pool_mgr->node_heap[u].alloc_record.offset >= offset) {
+            found = u;
+            u = addr[u].left;
+        } else {
+            u = addr[u].right;
+        }
+    }
+    return found == MEM_NIL ? NULL : &pool_mgr->node_heap[found];
+#endif
+}
+
+static size_t _mem_gap_ix_largest(pool_mgr_pt pool_mgr) {
+    if (!pool_mgr->pool.num_gaps) return 0;
+
+#ifdef MEM_POOL_GAP_ARRAY
+    // the gap index is sorted by size, so the largest gap is at the end
+    return pool_mgr->gap_ix[pool_mgr->pool.num_gaps - 1].size;
+#else
+    unsigned u = pool_mgr->gap_root;
+    while (pool_mgr->gap_tree[u].right != MEM_NIL) u = pool_mgr->gap_tree[u].right;
+    return pool_mgr->gap_ix[u].size;
+#endif
+}
+
+// empty the index, the nodes are left alone
+static void _mem_gap_ix_clear(pool_mgr_pt pool_mgr) {
+    // entries from node_top on have never been used
+    memset(pool_mgr->gap_ix, 0, pool_mgr->node_top * sizeof(gap_t));
+    memset(pool_mgr->stats.gap_hist, 0, sizeof(pool_mgr->stats.gap_hist));
+    pool_mgr->pool.num_gaps = 0;
+    pool_mgr->gap_root = MEM_NIL;
+    pool_mgr->gap_addr_root = MEM_NIL;
+}
+
+// bytes to allocate (or lay out) for a gap index of the given capacity,
+// the allocation lookup included
+static size_t _mem_gap_ix_bytes(unsigned capacity) {
+    size_t alloc_ix = (size_t) capacity * MEM_ALLOC_IX_SLOTS * sizeof(unsigned);
+#ifdef MEM_POOL_GAP_ARRAY
+    return capacity * sizeof(gap_t) + alloc_ix;
+#else
+    return capacity * (sizeof(gap_t) + sizeof(gap_link_t) + sizeof(gap_addr_link_t)) + alloc_ix;
+#endif
+}
+
+// point gap_tree past the entries and gap_addr past the links, whenever
+// gap_ix or its capacity change
+static void _mem_gap_ix_bind(pool_mgr_pt pool_mgr) {
+#ifdef MEM_POOL_GAP_ARRAY
+    pool_mgr->gap_tree = NULL;
+    pool_mgr->gap_addr = NULL;
+    pool_mgr->alloc_ix = (unsigned *) (pool_mgr->gap_ix + pool_mgr->gap_ix_capacity);
+#else
+    pool_mgr->gap_tree = (gap_link_pt) (pool_mgr->gap_ix + pool_mgr->gap_ix_capacity);
+    pool_mgr->gap_addr = (gap_addr_link_pt) (pool_mgr->gap_tree + pool_mgr->gap_ix_capacity);
+    pool_mgr->alloc_ix = (unsigned *) (pool_mgr->gap_addr + pool_mgr->gap_ix_capacity);
+#endif
+}
+
+// move the gap index to a block of a larger capacity: the entries and tree
+// links are indexed by node, so they are copied as they are; the allocation
+// lookup hashes into the new slot count, so it is rebuilt
+static alloc_status _mem_gap_ix_grow(pool_mgr_pt pool_mgr, unsigned capacity) {
+    if (capacity <= pool_mgr->gap_ix_capacity) return ALLOC_OK;
+
+    gap_pt old_ix = pool_mgr->gap_ix;
+    gap_link_pt old_tree = pool_mgr->gap_tree;
+    gap_addr_link_pt old_addr = pool_mgr->gap_addr;
+    unsigned old_capacity = pool_mgr->gap_ix_capacity;
+
+    gap_pt gap_ix = (gap_pt) _mem_line_calloc(1, _mem_gap_ix_bytes(capacity));
+    if (!gap_ix) return ALLOC_FAIL;
+
+    pool_mgr->gap_ix = gap_ix;
+    pool_mgr->gap_ix_capacity = capacity;
+    _mem_gap_ix_bind(pool_mgr);
+
+    memcpy(pool_mgr->gap_ix, old_ix, old_capacity * sizeof(gap_t));
+#ifndef MEM_POOL_GAP_ARRAY
+    memcpy(pool_mgr->gap_tree, old_tree, old_capacity * sizeof(gap_link_t));
+    memcpy(pool_mgr->gap_addr, old_addr, old_capacity * sizeof(gap_addr_link_t));
+#else
+    (void) old_tree;
+    (void) old_addr;
+#endif
+    free(old_ix);
+    _mem_alloc_ix_rebuild(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+// an unused node: a released one if any, otherwise the next never-used one
+static unsigned _mem_node_get(pool_mgr_pt pool_mgr) {
+    unsigned node = pool_mgr->free_node;
+
+    if (node != MEM_NIL)
+        pool_mgr->free_node = pool_mgr->node_heap[node].next;
+    else if (pool_mgr->node_top < pool_mgr->total_nodes)
+        node = pool_mgr->node_top ++;
+
+    return node;
+}
+
+// mark a node unused and keep it for _mem_node_get, it must be unlinked
+static void _mem_node_put(pool_mgr_pt pool_mgr, node_pt node) {
+    node->used = 0;
+    node->prev = MEM_NIL;
+    node->next = pool_mgr->free_node;
+    pool_mgr->free_node = (unsigned) (node - pool_mgr->node_heap);
+    pool_mgr->used_nodes --;
+}
+
+static size_t _mem_alloc_ix_home(pool_mgr_pt pool_mgr, size_t offset) {
+    uint64_t h = (uint64_t) offset;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    // scale the top 32 bits to the capacity, which needn't be a power of 2
+    // (the slot count may not fit in 32 bits), and pick the slot there
+    // with the bottom ones
+    size_t entry = (size_t) (((h >> 32) * pool_mgr->gap_ix_capacity) >> 32);
+    return entry * MEM_ALLOC_IX_SLOTS + (size_t) (h % MEM_ALLOC_IX_SLOTS);
+}
+
+// note: the node must be allocated, and not in the table yet
+static void _mem_alloc_ix_insert(pool_mgr_pt pool_mgr, unsigned node) {
+    size_t slots = (size_t) pool_mgr->gap_ix_capacity * MEM_ALLOC_IX_SLOTS;
+    size_t i = _mem_alloc_ix_home(pool_mgr, pool_mgr->node_heap[node].alloc_record.offset);
+
+    while (pool_mgr->alloc_ix[i]) i = i + 1 < slots ? i + 1 : 0;
+    pool_mgr->alloc_ix[i] = node + 1;
+}
+
+// the allocated node at offset, NULL if there is none
+static node_pt _mem_alloc_ix_find(pool_mgr_pt pool_mgr, size_t offset) {
+    size_t slots = (size_t) pool_mgr->gap_ix_capacity * MEM_ALLOC_IX_SLOTS;
+
+    for (size_t i = _mem_alloc_ix_home(pool_mgr, offset); pool_mgr->alloc_ix[i];
+         i = i + 1 < slots ? i + 1 : 0)
+    {
+        node_pt node = &pool_mgr->node_heap[pool_mgr->alloc_ix[i] - 1];
+        if (node->alloc_record.offset == offset) return node;
+    }
+    return NULL;
+}
+
+// note: the node must be in the table; the entries after it are shifted
+// back into the hole if that is no farther from their home slot
+static void _mem_alloc_ix_remove(pool_mgr_pt pool_mgr, node_pt node) {
+    size_t slots = (size_t) pool_mgr->gap_ix_capacity * MEM_ALLOC_IX_SLOTS;
+    unsigned *alloc_ix = pool_mgr->alloc_ix;
+    unsigned value = (unsigned) (node - pool_mgr->node_heap) + 1;
+
+    size_t hole = _mem_alloc_ix_home(pool_mgr, node->alloc_record.offset);
+    while (alloc_ix[hole] != value) hole = hole + 1 < slots ? hole + 1 : 0;
+
+    for (size_t i = hole + 1 < slots ? hole + 1 : 0; alloc_ix[i]; i = i + 1 < slots ? i + 1 : 0)
+    {
+        size_t home = _mem_alloc_ix_home(pool_mgr,
+                                         pool_mgr->node_heap[alloc_ix[i] - 1].alloc_record.offset);
+        // can move if home is not cyclically in (hole, i]
+        int stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (stays) continue;
+
+        alloc_ix[hole] = alloc_ix[i];
+        hole = i;
+    }
+    alloc_ix[hole] = 0;
+}
+
+// fill the table from the node list, it must be empty
+static void _mem_alloc_ix_rebuild(pool_mgr_pt pool_mgr) {
+    for (node_pt node = pool_mgr->node_heap; node; node = _mem_node_next(pool_mgr, node))
+    {
+        if (node->allocated)
+            _mem_alloc_ix_insert(pool_mgr, (unsigned) (node - pool_mgr->node_heap));
+    }
+}
+
+#ifndef MEM_POOL_GAP_ARRAY
+// the order of _mem_sort_gap_ix: by size, then by offset
+static int _mem_gap_less(pool_mgr_pt pool_mgr, unsigned a, unsigned b) {
+    gap_pt gap_ix = pool_mgr->gap_ix;
+
+    if (gap_ix[a].size != gap_ix[b].size) return gap_ix[a].size < gap_ix[b].size;
+    return pool_mgr->node_heap[a].alloc_record.offset < pool_mgr->node_heap[b].alloc_record.offset;
+}
+
+// treap priority, a hash of the entry's index so that nothing needs storing
+// and a pool in a file or shared mapping gets the same tree everywhere
+static unsigned _mem_gap_prio(unsigned gap) {
+    gap ^= gap >> 16;
+    gap *= 0x85ebca6bu;
+    gap ^= gap >> 13;
+    gap *= 0xc2b2ae35u;
+    gap ^= gap >> 16;
+    return gap;
+}
+
+// returns the new root of the subtree
+static unsigned _mem_gap_tree_insert(pool_mgr_pt pool_mgr, unsigned root, unsigned gap) {
+    gap_link_pt tree = pool_mgr->gap_tree;
+
+    if (root == MEM_NIL) return gap;
+
+    if (_mem_gap_less(pool_mgr, gap, root))
+    {
+        tree[root].left = _mem_gap_tree_insert(pool_mgr, tree[root].left, gap);
+        // rotate right if the child now outranks the root
+        unsigned child = tree[root].left;
+        if (_mem_gap_prio(child) > _mem_gap_prio(root))
+        {
+            tree[root].left = tree[child].right;
+            tree[child].right = root;
+            return child;
+        }
+    }
+    else
+    {
+        tree[root].right = _mem_gap_tree_insert(pool_mgr, tree[root].right, gap);
+        // rotate left
+        unsigned child = tree[root].right;
+        if (_mem_gap_prio(child) > _mem_gap_prio(root))
+        {
+            tree[root].right = tree[child].left;
+            tree[child].left = root;
+            return child;
+        }
+    }
+    return root;
+}
+
+// note: the entry must be in the subtree
+static unsigned _mem_gap_tree_remove(pool_mgr_pt pool_mgr, unsigned root, unsigned gap) {
+    gap_link_pt tree = pool_mgr->gap_tree;
+
+    assert(root != MEM_NIL);
+
+    if (root == gap)
+        return _mem_gap_tree_merge(pool_mgr, tree[gap].left, tree[gap].right);
+
+    if (_mem_gap_less(pool_mgr, gap, root))
+        tree[root].left = _mem_gap_tree_remove(pool_mgr, tree[root].left, gap);
+    else
+        tree[root].right = _mem_gap_tree_remove(pool_mgr, tree[root].right, gap);
+
+    return root;
+}
+
+// join two subtrees, everything in left ordered before everything in right
+static unsigned _mem_gap_tree_merge(pool_mgr_pt pool_mgr, unsigned left, unsigned right) {
+    gap_link_pt tree = pool_mgr->gap_tree;
+
+    if (left == MEM_NIL) return right;
+    if (right == MEM_NIL) return left;
+
+    if (_mem_gap_prio(left) > _mem_gap_prio(right))
+    {
+        tree[left].right = _mem_gap_tree_merge(pool_mgr, tree[left].right, right);
+        return left;
+    }
+    tree[right].left = _mem_gap_tree_merge(pool_mgr, left, tree[right].left);
+    return right;
+}
+
+// recompute the subtree maximum of an entry from its own size and children
+static void _mem_gap_addr_update(pool_mgr_pt pool_mgr, unsigned gap) {
+    gap_addr_link_pt addr = pool_mgr->gap_addr;
+    size_t max = pool_mgr->gap_ix[gap].size;
+
+    if (addr[gap].left != MEM_NIL && addr[addr[gap].left].max > max)
+        max = addr[addr[gap].left].max;
+    if (addr[gap].right != MEM_NIL && addr[addr[gap].right].max > max)
+        max = addr[addr[gap].right].max;
+    addr[gap].max = max;
+}
+
+// as _mem_gap_tree_insert, but ordered by offset alone (gaps never overlap)
+static unsigned _mem_gap_addr_insert(pool_mgr_pt pool_mgr, unsigned root, unsigned gap) {
+    gap_addr_link_pt addr = pool_mgr->gap_addr;
+    node_pt node_heap = pool_mgr->node_heap;
+
+    if (root == MEM_NIL) return gap;
+
+    if (node_heap[gap].alloc_record.offset < node_heap[root].alloc_record.offset)
+    {
+        addr[root].left = _mem_gap_addr_insert(pool_mgr, addr[root].left, gap);
+        unsigned child = addr[root].left;
+        if (_mem_gap_prio(child) > _mem_gap_prio(root))
+        {
+            addr[root].left = addr[child].right;
+            addr[child].right = root;
+            _mem_gap_addr_update(pool_mgr, root);
+            _mem_gap_addr_update(pool_mgr, child);
+            return child;
+        }
+    }
+    else
+    {
+        addr[root].right = _mem_gap_addr_insert(pool_mgr, addr[root].right, gap);
+        unsigned child = addr[root].right;
+        if (_mem_gap_prio(child) > _mem_gap_prio(root))
+        {
+            addr[root].right = addr[child].left;
+            addr[child].left = root;
+            _mem_gap_addr_update(pool_mgr, root);
+            _mem_gap_addr_update(pool_mgr, child);
+            return child;
+        }
+    }
+    _mem_gap_addr_update(pool_mgr, root);
+    return root;
+}
+
+// note: the entry must be in the subtree
+static unsigned _mem_gap_addr_remove(pool_mgr_pt pool_mgr, unsigned root, unsigned gap) {
+    gap_addr_link_pt addr = pool_mgr->gap_addr;
+    node_pt node_heap = pool_mgr->node_heap;
+
+    assert(root != MEM_NIL);
+
+    if (root == gap)
+        return _mem_gap_addr_merge(pool_mgr, addr[gap].left, addr[gap].right);
+
+    if (node_heap[gap].alloc_record.offset < node_heap[root].alloc_record.offset)
+        addr[root].left = _mem_gap_addr_remove(pool_mgr, addr[root].left, gap);
+    else
+        addr[root].right = _mem_gap_addr_remove(pool_mgr, addr[root].right, gap);
+
+    _mem_gap_addr_update(pool_mgr, root);
+    return root;
+}
+
+static unsigned _mem_gap_addr_merge(pool_mgr_pt pool_mgr, unsigned left, unsigned right) {
+    gap_addr_link_pt addr = pool_mgr->gap_addr;
+
+    if (left == MEM_NIL) return right;
+    if (right == MEM_NIL) return left;
+
+    if (_mem_gap_prio(left) > _mem_gap_prio(right))
+    {
+        addr[left].right = _mem_gap_addr_merge(pool_mgr, addr[left].right, right);
+        _mem_gap_addr_update(pool_mgr, left);
+        return left;
+    }
+    addr[right].left = _mem_gap_addr_merge(pool_mgr, left, addr[right].left);
+    _mem_gap_addr_update(pool_mgr, right);
+    return right;
+}
+#endif
+
+static alloc_status _mem_invalidate_gap_ix(pool_mgr_pt pool_mgr) {
+    return ALLOC_FAIL;
+}
+
+// the request rounded up to one of 4 classes per power of 2 (so by less
+// than a quarter), at least MEM_ADAPT_MIN_CLASS
+static size_t _mem_size_class(size_t size) {
+    if (size <= MEM_ADAPT_MIN_CLASS) return MEM_ADAPT_MIN_CLASS;
+
+    unsigned bits = 0;
+    for (size_t rest = size - 1; rest >>= 1; ) ++ bits;
+    size_t step = (size_t) 1 << (bits - 2);
+    // too close to SIZE_MAX to round, and too big for any pool anyway
+    if (size > SIZE_MAX - (step - 1)) return size;
+
+    return (size + step - 1) & ~(step - 1);
+}
+
+static void _mem_adapt_sample(pool_mgr_pt pool_mgr, size_t size, unsigned search_len) {
+    adapt_sample_t *sample = &pool_mgr->adapt;
+    size_t size_class = _mem_size_class(size);
+
+    sample->allocs ++;
+    sample->search_len += search_len;
+
+    unsigned c = 0;
+    while (c < MEM_ADAPT_CLASSES && sample->class_size[c] && sample->class_size[c] != size_class) ++ c;
+    if (c == MEM_ADAPT_CLASSES) {
+        sample->other ++;
+    } else {
+        sample->class_size[c] = size_class;
+        sample->class_count[c] ++;
+    }
+
+    if (sample->allocs >= MEM_ADAPT_WINDOW) _mem_adapt_decide(pool_mgr);
+}
+
+// switching needs no rebuild: the gap index answers first-fit and best-fit
+// queries alike, and blocks rounded to a class are ordinary allocations
+static void _mem_adapt_decide(pool_mgr_pt pool_mgr) {
+    adapt_sample_t *sample = &pool_mgr->adapt;
+    pool_stats_pt stats = &pool_mgr->stats;
+    alloc_policy policy = BEST_FIT;
+    unsigned size_classes = 0;
+
+    if (sample->frees * MEM_ADAPT_BULK_RATIO < sample->allocs)
+    {
+        // bulk load: first-fit packs it in request order from the bottom,
+        // unless walking to the first fit has become the cost
+        if (stats->active_policy == FIRST_FIT &&
+            sample->search_len > (unsigned long) MEM_ADAPT_MAX_SEARCH * sample->allocs)
+            sample->slow_first_fit = 1;
+        if (!sample->slow_first_fit) policy = FIRST_FIT;
+    }
+    else
+    {
+        // churn: best-fit keeps the big gaps whole, and requests of a few
+        // sizes rounded to their classes reuse each other's blocks exactly
+        sample->slow_first_fit = 0;
+        size_classes = (unsigned long) sample->other * 100 <=
+                       (unsigned long) (100 - MEM_ADAPT_CLUSTERED) * sample->allocs;
+    }
+
+    if (policy != stats->active_policy || size_classes != stats->size_classes)
+    {
+        stats->active_policy = policy;
+        stats->size_classes = size_classes;
+        stats->policy_switch_count ++;
+    }
+
+    unsigned slow_first_fit = sample->slow_first_fit;
+    memset(sample, 0, sizeof(*sample));
+    sample->slow_first_fit = slow_first_fit;
+}
+
+// gap size histogram bucket: floor(log2(size)), the last bucket is open-ended
+static unsigned _mem_gap_hist_bucket(size_t size) {
+    unsigned bucket = 0;
+    while (size >>= 1) ++ bucket;
+    return bucket < MEM_STATS_HIST_BUCKETS ? bucket : MEM_STATS_HIST_BUCKETS - 1;
+}
+
+#ifdef MEM_POOL_LATENCY
+// monotonic nanoseconds, or raw TSC ticks when asked for and available
+static unsigned long long _mem_lat_now() {
+#if defined(MEM_POOL_LATENCY_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void _mem_lat_record(pool_mgr_pt pool_mgr, latency_op op, unsigned long long value) {
+    latency_hist_pt hist = &pool_mgr->latency[op];
+
+    if (!hist->count || value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+    hist->total += value;
+    hist->count ++;
+    hist->buckets[_mem_lat_bucket(value)] ++;
+}
+
+// log-linear bucket: exact below 2^MEM_LAT_SUB_BITS, then the top
+// MEM_LAT_SUB_BITS bits below the leading one pick the sub-bucket
+static unsigned _mem_lat_bucket(unsigned long long value) {
+    const unsigned sub_count = 1u << MEM_LAT_SUB_BITS;
+
+    if (value < sub_count) return (unsigned) value;
+
+    unsigned magnitude = 0;
+    for (unsigned long long v = value; v >>= 1; ) ++ magnitude;
+
+    unsigned sub = (unsigned) (value >> (magnitude - MEM_LAT_SUB_BITS)) & (sub_count - 1);
+    unsigned bucket = (magnitude - MEM_LAT_SUB_BITS + 1) * sub_count + sub;
+
+    return bucket < MEM_LAT_BUCKETS ? bucket : MEM_LAT_BUCKETS - 1;
+}
+#endif
+
+// largest value that falls into the bucket
+static unsigned long long _mem_lat_bucket_high(unsigned bucket) {
+    const unsigned sub_count = 1u << MEM_LAT_SUB_BITS;
+
+    if (bucket < sub_count) return bucket;
+
+    unsigned shift = bucket / sub_count - 1;
+    unsigned long long sub = bucket % sub_count;
+
+    return ((sub_count + sub + 1) << shift) - 1;
+}
+
+#ifdef MEM_POOL_TRACE
+static void _mem_trace_record(trace_op op, unsigned pool_id,
+                              uint64_t offset, uint64_t size, unsigned result) {
+    trace_ring_pt ring = trace_ring;
+
+    if (!ring)
+    {
+        // first event on this thread: allocate its ring and publish it
+        ring = (trace_ring_pt) calloc(1, sizeof(trace_ring_t));
+        if (!ring) return;
+        ring->thread_id = atomic_fetch_add(&trace_next_thread_id, 1);
+        ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+            ;
+        trace_ring = ring;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_record_pt record = &ring->records[head & (MEM_TRACE_RING_CAPACITY - 1)];
+
+    record->timestamp = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    record->offset = offset;
+    record->size = size;
+    record->pool_id = pool_id;
+    record->thread_id = (uint16_t) ring->thread_id;
+    record->op = (uint8_t) op;
+    record->result = (uint8_t) result;
+
+    // publish the record to mem_trace_dump
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+#endif
@@ -5,9 +5,16 @@
 #ifndef MEM_POOL_H
 #define MEM_POOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 /* type declarations */
 
-typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
+// ADAPTIVE: the pool watches its requests and places them first-fit while
+// it's mostly allocating, best-fit once it's churning, and then rounds them
+// up to size classes if they come in a few sizes (see mem_pool_stats())
+typedef enum _alloc_policy { FIRST_FIT, BEST_FIT, ADAPTIVE } alloc_policy;
 
 typedef struct _pool {
     char *mem;
@@ -23,6 +30,105 @@ typedef struct _pool_segment {
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
 } pool_segment_t, *pool_segment_pt;
 
+// pool statistics, see mem_pool_stats()
+#define MEM_STATS_HIST_BUCKETS 32
+
+typedef struct _pool_stats {
+    size_t largest_gap;
+    size_t free_size;               // total_size - alloc_size
+    double fragmentation;           // external: 1 - largest_gap / free_size
+    unsigned gap_hist[MEM_STATS_HIST_BUCKETS]; // gaps by floor(log2(size)), last is open-ended
+    size_t peak_alloc_size;
+    unsigned long alloc_count;      // successful mem_new_alloc calls
+    unsigned long free_count;       // successful mem_del_alloc calls
+    unsigned long fail_count;       // failed mem_new_alloc calls
+    unsigned long split_count;      // allocations that left a remainder gap
+    unsigned long coalesce_count;   // gap merges on deallocation
+    double avg_search_len;          // nodes/entries examined per mem_new_alloc
+    unsigned long zero_fill_count;  // mem_new_alloc_zeroed calls that cleared memory
+    unsigned long zero_skip_count;  // ... that took a gap known to be zero already
+    size_t released_size;           // bytes of gap pages given back to the OS by maintenance
+    size_t prezeroed_size;          // bytes of gaps cleared by maintenance
+    unsigned long resize_count;     // node heap (and gap index) expansions
+    alloc_policy active_policy;     // FIRST_FIT or BEST_FIT placement in effect
+    unsigned size_classes;          // 1 while requests are rounded up to size classes
+    unsigned long policy_switch_count; // ADAPTIVE: changes of either of the above
+} pool_stats_t, *pool_stats_pt;
+
+// latency histograms, see mem_pool_latency()
+// log-linear: values below 2^MEM_LAT_SUB_BITS get a bucket each, every power
+// of two above that is split into 2^MEM_LAT_SUB_BITS linear sub-buckets
+// note: only recorded when the library is built with MEM_POOL_LATENCY
+#define MEM_LAT_SUB_BITS 3
+#define MEM_LAT_MAGNITUDES 40
+#define MEM_LAT_BUCKETS (MEM_LAT_MAGNITUDES << MEM_LAT_SUB_BITS)
+
+typedef enum _latency_op {
+    MEM_LAT_ALLOC,      // whole mem_new_alloc call
+    MEM_LAT_FREE,       // whole mem_del_alloc call
+    MEM_LAT_SEARCH,     // gap search inside mem_new_alloc
+    MEM_LAT_INDEX,      // gap index maintenance in both calls
+    MEM_LAT_NUM_OPS
+} latency_op;
+
+typedef struct _latency_hist {
+    unsigned long count;
+    unsigned long long min, max, total; // ns, or TSC ticks with MEM_POOL_LATENCY_RDTSC
+    unsigned long buckets[MEM_LAT_BUCKETS];
+} latency_hist_t, *latency_hist_pt;
+
+// event tracing, see mem_trace_dump()
+// note: only recorded when the library is built with MEM_POOL_TRACE
+// trace file: a trace_file_header_t followed by count trace_record_t-s,
+// grouped per thread and in time order within each thread
+#define MEM_TRACE_MAGIC 0x5254504du // "MPTR"
+#define MEM_TRACE_VERSION 1
+
+typedef enum _trace_op {
+    MEM_TRACE_OPEN,     // offset = policy, size = pool size
+    MEM_TRACE_ALLOC,    // offset = allocation offset in the pool (UINT64_MAX on failure)
+    MEM_TRACE_FREE,     // offset = allocation offset in the pool
+    MEM_TRACE_CLOSE,    // mem_pool_close and mem_pool_close_force
+    MEM_TRACE_CLEAR
+} trace_op;
+
+typedef struct _trace_record {
+    uint64_t timestamp; // CLOCK_MONOTONIC ns
+    uint64_t offset;
+    uint64_t size;
+    uint32_t pool_id;   // unique per process, from mem_pool_open
+    uint16_t thread_id;
+    uint8_t op;         // trace_op
+    uint8_t result;     // alloc_status
+} trace_record_t, *trace_record_pt;
+
+typedef struct _trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t count;
+} trace_file_header_t;
+
+// sizing hints for mem_pool_open_ex(), 0 where unknown
+// MEM_OPEN_EMBEDDED: the pool is a single mapping with the manager, node heap
+// and gap index ahead of the pool memory; the metadata is sized once (from
+// the hints, or one node per 64 bytes of pool, resident only once used),
+// so an embedded pool runs out of nodes instead of growing
+#define MEM_OPEN_EMBEDDED 0x1u
+// MEM_OPEN_TEMPLATE: the pool memory is a mapping of a memfd, so that
+// mem_pool_clone maps it copy-on-write instead of copying it; the first clone
+// freezes the memfd, and later clones also copy the pages the template has
+// written since; not together with MEM_OPEN_EMBEDDED
+#define MEM_OPEN_TEMPLATE 0x2u
+
+typedef struct _pool_open_opts {
+    unsigned expected_allocs;   // live allocations at the peak
+    size_t typical_size;        // stands in for expected_allocs (as size / typical_size)
+    unsigned max_gaps;          // gaps at the peak, expected_allocs + 1 if unknown
+    unsigned flags;             // MEM_OPEN_*
+} pool_open_opts_t, *pool_open_opts_pt;
+
 typedef enum _alloc_status {
     ALLOC_OK,
     ALLOC_FAIL,
@@ -30,6 +136,25 @@ typedef enum _alloc_status {
     ALLOC_NOT_FREED
 } alloc_status;
 
+// inline fast path for small allocations, see mem_pool_fast(): requests of
+// up to MEM_FAST_MAX bytes are rounded up to a multiple of MEM_FAST_GRAIN
+// (so aligned to it) and served from a quick list per class, or else cut
+// from the bump region, a chunk of up to MEM_FAST_CHUNK bytes taken from
+// the pool with mem_new_alloc
+#define MEM_FAST_GRAIN 16
+#define MEM_FAST_CLASSES 8
+#define MEM_FAST_MAX (MEM_FAST_GRAIN * MEM_FAST_CLASSES)
+#define MEM_FAST_CHUNK (64 * 1024)
+
+typedef struct _pool_fast {
+    char *next;                     // the rest of the bump region
+    char *end;
+    void *lists[MEM_FAST_CLASSES];  // freed objects, linked through their first bytes
+    unsigned long live;             // objects handed out and not freed
+    void *chunks;                   // linked through their first bytes
+    pool_pt pool;
+} pool_fast_t, *pool_fast_pt;
+
 /* function declarations */
 
 alloc_status
@@ -38,18 +163,204 @@ mem_init();
 alloc_status
 mem_free();
 
+// background maintenance of all open pools, every interval_ms: gaps of
+// 64KB or more have their pages given back to the OS, and smaller gaps
+// written since they were last clear are cleared, so mem_new_alloc_zeroed
+// can skip them; pools busy at the time are left for the next pass
+// note: start and stop while no other thread is using the library; while
+//       it runs, every pool operation takes a per-pool lock
+alloc_status
+mem_maint_start(unsigned interval_ms);
+
+alloc_status
+mem_maint_stop();
+
+// one maintenance pass in the calling thread
+alloc_status
+mem_maint_run();
+
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+// as mem_pool_open, with the node heap and gap index allocated up front for
+// the hinted number of allocations and gaps, so they don't grow on the way
+// there; opts NULL is the same as mem_pool_open
+pool_pt
+mem_pool_open_ex(size_t size, alloc_policy policy, const pool_open_opts_t *opts);
+
+// a pool managing the caller's memory (a static arena, a stack buffer, a
+// pre-faulted or DMA-registered mapping, ...): nothing is allocated for the
+// pool memory, and closing (only once empty) leaves it to the caller; it's
+// not taken to be zero, and its pages are never released
+pool_pt
+mem_pool_open_on(void *buf, size_t size, alloc_policy policy);
+
+// a pool whose memory is one allocation in the parent pool: closing it
+// returns that allocation whatever the sub-pool still holds, so everything
+// in it is freed at once; a pool with open sub-pools can't be closed
+pool_pt
+mem_subpool_open(pool_pt parent, size_t size, alloc_policy policy);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
+// as mem_pool_close, but a pool still holding allocations is closed too (as
+// if mem_pool_clear-ed first); a pool with open sub-pools still isn't
+alloc_status
+mem_pool_close_force(pool_pt pool);
+
+// deallocate everything in the pool at once: the pool is a single gap
+// again, without coalescing or gap index work per allocation; every
+// pointer into the pool is invalid after it, and a pool with open
+// sub-pools isn't cleared
+alloc_status
+mem_pool_clear(pool_pt pool);
+
+// NUMA placement: the pool memory is bound to the given node, or spread
+// over the allowed nodes with MEM_NUMA_INTERLEAVE; kernels without NUMA
+// support get an unbound pool, an invalid node fails the open
+#define MEM_NUMA_INTERLEAVE (-1)
+
+pool_pt
+mem_pool_open_numa(size_t size, alloc_policy policy, int node);
+
+int
+mem_numa_local_node();
+
+// file-backed pool: creates the pool in an empty (or new) file, or
+// reattaches to the pool already in it (size 0 or equal to the stored size,
+// policy ignored); closing detaches and leaves the allocations in the file
+// path NULL: an anonymous file (memfd)
+// note: a file can only be open once at a time, the pool is locked to it
+pool_pt
+mem_pool_open_file(const char *path, size_t size, alloc_policy policy);
+
+// copy of a pool, allocations included, as it is at the call; the memory of
+// template (MEM_OPEN_TEMPLATE) pools is shared copy-on-write, that of other
+// pools is copied
+// note: a clone can be closed with live allocations, a template can't be
+//       closed while it has open clones
+pool_pt
+mem_pool_clone(pool_pt pool);
+
+// shared pool: a POSIX shared memory object (name as for shm_open) that
+// several processes open at once; the first open creates it with the given
+// size and policy, the others attach (size 0 or equal); allocations are
+// passed between processes as offsets, see mem_pool_offset/mem_pool_ptr
+// note: the pool is locked for each call, closing detaches, the object
+//       lives until mem_pool_unlink_shared
+pool_pt
+mem_pool_open_shared(const char *name, size_t size, alloc_policy policy);
+
+alloc_status
+mem_pool_unlink_shared(const char *name);
+
+alloc_status
+mem_pool_sync(pool_pt pool);
+
+// checkpoint: writes the pool's segments and the contents of its allocations
+// (not of its gaps) to fd; restore reads one back into a new heap pool, with
+// the allocations at the same offsets
+alloc_status
+mem_pool_snapshot(pool_pt pool, int fd);
+
+pool_pt
+mem_pool_restore(int fd);
+
+size_t
+mem_pool_offset(pool_pt pool, const void *alloc);
+
+void *
+mem_pool_ptr(pool_pt pool, size_t offset);
+
 void *
 mem_new_alloc(pool_pt pool, size_t size);
 
+// as mem_new_alloc, but the allocation is all zero bytes; the pool keeps
+// track of gaps that haven't been written since they were mapped (or
+// cleared), and only allocations from other gaps are cleared
+void *
+mem_new_alloc_zeroed(pool_pt pool, size_t size);
+
 alloc_status
 mem_del_alloc(pool_pt pool, void *alloc);
 
+// the pool's small allocation cache, for mem_fast_alloc and mem_fast_free;
+// NULL for file-backed and shared pools, whose metadata can't hold pointers
+// note: objects from it must go back through mem_fast_free, with their
+//       size; the pool counts the chunks, which go back once no object is
+//       live at mem_pool_close (or with mem_pool_clear/mem_pool_close_force)
+// note: the cache has a single owner: mem_fast_alloc and mem_fast_free
+//       update it without any lock, also while maintenance makes the rest
+//       of the API lock the pool, so only one thread at a time may use it
+pool_fast_pt
+mem_pool_fast(pool_pt pool);
+
+// the miss path of mem_fast_alloc: takes another chunk for the bump region,
+// after putting what's left of the last one on the quick lists
+void *
+mem_fast_refill(pool_fast_pt fast, size_t size);
+
+static inline void *
+mem_fast_alloc(pool_fast_pt fast, size_t size) {
+    // sizes above MEM_FAST_MAX (and 0) are for mem_new_alloc
+    if (size - 1 >= MEM_FAST_MAX) return mem_new_alloc(fast->pool, size);
+
+    unsigned c = (unsigned) ((size - 1) / MEM_FAST_GRAIN);
+    void *obj = fast->lists[c];
+    if (obj) {
+        memcpy(&fast->lists[c], obj, sizeof(void *));
+        fast->live ++;
+        return obj;
+    }
+
+    size_t bytes = (size_t) (c + 1) * MEM_FAST_GRAIN;
+    if ((size_t) (fast->end - fast->next) >= bytes) {
+        obj = fast->next;
+        fast->next += bytes;
+        fast->live ++;
+        return obj;
+    }
+
+    return mem_fast_refill(fast, size);
+}
+
+static inline void
+mem_fast_free(pool_fast_pt fast, void *alloc, size_t size) {
+    if (size - 1 >= MEM_FAST_MAX) {
+        mem_del_alloc(fast->pool, alloc);
+        return;
+    }
+
+    unsigned c = (unsigned) ((size - 1) / MEM_FAST_GRAIN);
+    memcpy(alloc, &fast->lists[c], sizeof(void *));
+    fast->lists[c] = alloc;
+    fast->live --;
+}
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
+
+alloc_status
+mem_pool_stats(pool_pt pool, pool_stats_pt stats);
+
+alloc_status
+mem_pool_latency(pool_pt pool, latency_op op, latency_hist_pt hist);
+
+alloc_status
+mem_pool_latency_reset(pool_pt pool);
+
+unsigned long long
+mem_latency_percentile(const latency_hist_t *hist, double q);
+
+// writes the records the threads' rings hold (the most recent of each) to
+// path, each ring up to where it was when the dump started
+// note: the records are copied while their threads may go on recording, and
+//       one that records a whole ring's worth meanwhile overwrites records
+//       being copied; dump while the traced threads are quiescent
+alloc_status
+mem_trace_dump(const char *path);
+
+alloc_status
+mem_trace_reset();
 #endif //C_MEM_POOL_H
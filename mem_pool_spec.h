@@ -0,0 +1,74 @@
+//
+// Compile-time specialized allocators on top of mem_pool.
+//
+//   MEM_POOL_SPECIALIZE(name, obj_size, obj_align, policy)
+//
+// defines the type name_t and these, all static inline:
+//
+//   int          name_open(name_t *a, size_t pool_size)   - in a new pool of the policy
+//   int          name_open_in(name_t *a, pool_pt parent, size_t size)
+//                                                          - in a sub-pool of parent
+//   void *       name_alloc(name_t *a)                     - NULL if the pool is full
+//   void         name_free(name_t *a, void *obj)
+//   alloc_status name_close(name_t *a)                     - ALLOC_NOT_FREED while objects
+//                                                            are live, as mem_pool_close
+//
+// An instance is the pool's fast path (see mem_pool_fast()) with the object
+// size fixed: objects of obj_size bytes (at most MEM_FAST_MAX), aligned to
+// obj_align (a power of 2, at most MEM_FAST_GRAIN), so name_alloc and
+// name_free compile to the quick list or bump region of a single class,
+// with the class picked at compile time. The policy places the chunks the
+// objects are cut from; any free object fits exactly, so reusing one takes
+// no placement decision. The pool (a->pool) stays usable with the generic
+// API for everything else, and mem_pool_close_force(a->pool) drops every
+// object at once.
+//
+// note: like the pools, an instance is not thread-safe
+//
+
+#ifndef MEM_POOL_SPEC_H
+#define MEM_POOL_SPEC_H
+
+#include "mem_pool.h"
+
+#define MEM_POOL_SPECIALIZE(name, obj_size, obj_align, policy)                              \
+                                                                                            \
+_Static_assert((obj_align) > 0 && ((obj_align) & ((obj_align) - 1)) == 0,                   \
+               #name ": the alignment must be a power of 2");                               \
+_Static_assert((obj_align) <= MEM_FAST_GRAIN,                                               \
+               #name ": the fast path aligns to MEM_FAST_GRAIN at most");                   \
+_Static_assert((obj_size) > 0 && (obj_size) <= MEM_FAST_MAX,                                \
+               #name ": the objects must be small enough for the fast path");               \
+                                                                                            \
+typedef struct _##name {                                                                    \
+    pool_pt pool;                                                                           \
+    pool_fast_pt fast;                                                                      \
+} name##_t;                                                                                 \
+                                                                                            \
+static inline int name##_open(name##_t *a, size_t pool_size) {                              \
+    pool_pt pool = mem_pool_open(pool_size, (policy));                                      \
+    *a = (name##_t) { pool, mem_pool_fast(pool) };                                          \
+    return a->pool != NULL;                                                                 \
+}                                                                                           \
+                                                                                            \
+static inline int name##_open_in(name##_t *a, pool_pt parent, size_t size) {                \
+    pool_pt pool = mem_subpool_open(parent, size, (policy));                                \
+    *a = (name##_t) { pool, mem_pool_fast(pool) };                                          \
+    return a->pool != NULL;                                                                 \
+}                                                                                           \
+                                                                                            \
+static inline void *name##_alloc(name##_t *a) {                                             \
+    return mem_fast_alloc(a->fast, (obj_size));                                             \
+}                                                                                           \
+                                                                                            \
+static inline void name##_free(name##_t *a, void *obj) {                                    \
+    mem_fast_free(a->fast, obj, (obj_size));                                                \
+}                                                                                           \
+                                                                                            \
+static inline alloc_status name##_close(name##_t *a) {                                      \
+    alloc_status result = mem_pool_close(a->pool);                                          \
+    if (result == ALLOC_OK) *a = (name##_t) { NULL, NULL };                                 \
+    return result;                                                                          \
+}
+
+#endif // MEM_POOL_SPEC_H
@@ -0,0 +1,418 @@
+//
+// Trace-replay driver: replays a recorded (see mem_trace_dump) or
+// synthetic allocation trace against each allocation policy and reports
+// throughput, latency percentiles, peak usage, failures and fragmentation.
+//
+// usage: msl-clang-003-replay <trace-file>
+//        msl-clang-003-replay --synthetic [num_ops [seed]]
+//
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem_pool.h"
+
+
+/*****            constants            *****/
+
+static const alloc_policy POLICIES[] = { FIRST_FIT, BEST_FIT, ADAPTIVE };
+static const char *POLICY_NAMES[]    = { "FIRST_FIT", "BEST_FIT", "ADAPTIVE" };
+static const unsigned NUM_POLICIES   = sizeof(POLICIES) / sizeof(POLICIES[0]);
+
+static const unsigned SYNTH_DEFAULT_OPS  = 100000;
+static const size_t   SYNTH_POOL_SIZE    = 64 * 1024 * 1024;
+static const size_t   SYNTH_MIN_SIZE     = 16;
+static const unsigned SYNTH_SIZE_CLASSES = 12; // log-uniform 16 B .. 32 KB
+
+
+/*****             types               *****/
+
+typedef struct _trace {
+    trace_record_pt records;
+    size_t count;
+} trace_t;
+
+// a record and where it was in the dump, which holds each thread's records
+// in the order they were written
+typedef struct _ordered_record {
+    trace_record_t record;
+    size_t position;
+} ordered_record_t;
+
+// live allocations of the replay, keyed by (pool id, offset in the trace)
+typedef struct _live_entry {
+    uint32_t pool_id;
+    uint64_t offset;
+    void *alloc;        // NULL marks an empty slot
+} live_entry_t;
+
+typedef struct _live_map {
+    live_entry_t *slots;
+    size_t capacity;    // power of two
+    size_t size;
+} live_map_t;
+
+typedef struct _replay_pool {
+    uint32_t id;
+    pool_pt pool;
+    double fragmentation;   // last observed
+} replay_pool_t;
+
+typedef struct _replay_result {
+    size_t ops;
+    double seconds;
+    unsigned long long *alloc_ns;
+    size_t num_allocs;
+    size_t num_failed;
+    size_t peak_alloc_size;
+    double fragmentation;   // mean over pools, at close or end of trace
+} replay_result_t;
+
+
+/*****         helper routines         *****/
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+// merge the per-thread runs of a dump into one time-ordered stream; qsort
+// isn't stable, so records of a thread with the same timestamp (e.g. an
+// allocation and its free) are kept in order by their position
+static int compare_records(const void *a, const void *b) {
+    const ordered_record_t *x = a, *y = b;
+    if (x->record.timestamp != y->record.timestamp)
+        return x->record.timestamp < y->record.timestamp ? -1 : 1;
+    if (x->record.thread_id != y->record.thread_id)
+        return x->record.thread_id < y->record.thread_id ? -1 : 1;
+    return (x->position > y->position) - (x->position < y->position);
+}
+
+static size_t live_hash(uint32_t pool_id, uint64_t offset, size_t capacity) {
+    uint64_t h = (offset ^ ((uint64_t) pool_id << 40)) * 0x9e3779b97f4a7c15ull;
+    return (size_t) (h >> 20) & (capacity - 1);
+}
+
+static int live_init(live_map_t *map) {
+    map->capacity = 1024;
+    map->size = 0;
+    map->slots = calloc(map->capacity, sizeof(live_entry_t));
+    return map->slots != NULL;
+}
+
+static int live_put(live_map_t *map, uint32_t pool_id, uint64_t offset, void *alloc);
+
+static int live_grow(live_map_t *map) {
+    live_map_t bigger = { calloc(map->capacity * 2, sizeof(live_entry_t)), map->capacity * 2, 0 };
+    if (!bigger.slots) return 0;
+    for (size_t i = 0; i < map->capacity; ++i)
+        if (map->slots[i].alloc)
+            live_put(&bigger, map->slots[i].pool_id, map->slots[i].offset, map->slots[i].alloc);
+    free(map->slots);
+    *map = bigger;
+    return 1;
+}
+
+static int live_put(live_map_t *map, uint32_t pool_id, uint64_t offset, void *alloc) {
+    if ((map->size + 1) * 2 > map->capacity && !live_grow(map)) return 0;
+
+    size_t i = live_hash(pool_id, offset, map->capacity);
+    while (map->slots[i].alloc &&
+           !(map->slots[i].pool_id == pool_id && map->slots[i].offset == offset))
+        i = (i + 1) & (map->capacity - 1);
+
+    if (!map->slots[i].alloc) map->size ++;
+    map->slots[i] = (live_entry_t) { pool_id, offset, alloc };
+    return 1;
+}
+
+// removes the entry and returns its allocation, or NULL if not live
+static void *live_take(live_map_t *map, uint32_t pool_id, uint64_t offset) {
+    size_t i = live_hash(pool_id, offset, map->capacity);
+    while (map->slots[i].alloc &&
+           !(map->slots[i].pool_id == pool_id && map->slots[i].offset == offset))
+        i = (i + 1) & (map->capacity - 1);
+
+    void *alloc = map->slots[i].alloc;
+    if (!alloc) return NULL;
+
+    // backward-shift deletion keeps the probe sequences intact
+    size_t hole = i;
+    for (size_t j = (i + 1) & (map->capacity - 1); map->slots[j].alloc;
+         j = (j + 1) & (map->capacity - 1)) {
+        size_t home = live_hash(map->slots[j].pool_id, map->slots[j].offset, map->capacity);
+        if (((j - home) & (map->capacity - 1)) >= ((j - hole) & (map->capacity - 1))) {
+            map->slots[hole] = map->slots[j];
+            hole = j;
+        }
+    }
+    map->slots[hole].alloc = NULL;
+    map->size --;
+    return alloc;
+}
+
+// forget all of a pool's allocations, once it's cleared or closed
+static int live_drop_pool(live_map_t *map, uint32_t pool_id) {
+    live_map_t kept = { calloc(map->capacity, sizeof(live_entry_t)), map->capacity, 0 };
+    if (!kept.slots) return 0;
+    for (size_t i = 0; i < map->capacity; ++i)
+        if (map->slots[i].alloc && map->slots[i].pool_id != pool_id)
+            live_put(&kept, map->slots[i].pool_id, map->slots[i].offset, map->slots[i].alloc);
+    free(map->slots);
+    *map = kept;
+    return 1;
+}
+
+static replay_pool_t *find_pool(replay_pool_t *pools, size_t num_pools, uint32_t id) {
+    for (size_t i = 0; i < num_pools; ++i)
+        if (pools[i].id == id && pools[i].pool) return &pools[i];
+    return NULL;
+}
+
+static double pool_fragmentation(pool_pt pool, size_t *peak) {
+    pool_stats_t stats;
+    if (mem_pool_stats(pool, &stats) != ALLOC_OK) return 0.0;
+    if (stats.peak_alloc_size > *peak) *peak = stats.peak_alloc_size;
+    return stats.fragmentation;
+}
+
+
+/*****          trace sources          *****/
+
+static int load_trace(const char *path, trace_t *trace) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return 0;
+    }
+
+    trace_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != MEM_TRACE_MAGIC ||
+        header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s: not a mem_pool trace\n", path);
+        fclose(file);
+        return 0;
+    }
+
+    trace->records = malloc(header.count * sizeof(trace_record_t));
+    trace->count = fread(trace->records, sizeof(trace_record_t), header.count, file);
+    fclose(file);
+
+    if (trace->count != header.count)
+        fprintf(stderr, "%s: truncated, replaying %zu of %llu records\n",
+                path, trace->count, (unsigned long long) header.count);
+
+    ordered_record_t *ordered = malloc((trace->count + 1) * sizeof(ordered_record_t));
+    if (!ordered) return 0;
+    for (size_t i = 0; i < trace->count; ++i)
+        ordered[i] = (ordered_record_t) { trace->records[i], i };
+    qsort(ordered, trace->count, sizeof(ordered_record_t), compare_records);
+    for (size_t i = 0; i < trace->count; ++i)
+        trace->records[i] = ordered[i].record;
+    free(ordered);
+
+    return 1;
+}
+
+// one pool, a random mix of allocations (log-uniform sizes) and frees of
+// random live allocations; offsets are synthetic but unique
+static int synthesize_trace(unsigned num_ops, unsigned seed, trace_t *trace) {
+    trace->records = malloc((num_ops + 2) * sizeof(trace_record_t));
+    uint64_t *live = malloc(num_ops * sizeof(uint64_t));
+    if (!trace->records || !live) return 0;
+
+    size_t n = 0, num_live = 0;
+    uint64_t next_offset = 0;
+
+    srand(seed);
+    trace->records[n++] = (trace_record_t) { 0, FIRST_FIT, SYNTH_POOL_SIZE, 1, 0, MEM_TRACE_OPEN, ALLOC_OK };
+
+    for (unsigned i = 0; i < num_ops; ++i) {
+        if (num_live && rand() % 100 < 45) {
+            size_t victim = (size_t) rand() % num_live;
+            trace->records[n] = (trace_record_t) { i + 1, live[victim], 0, 1, 0, MEM_TRACE_FREE, ALLOC_OK };
+            live[victim] = live[--num_live];
+        } else {
+            size_t size = SYNTH_MIN_SIZE << (rand() % SYNTH_SIZE_CLASSES);
+            size += (size_t) rand() % size;
+            trace->records[n] = (trace_record_t) { i + 1, next_offset, size, 1, 0, MEM_TRACE_ALLOC, ALLOC_OK };
+            live[num_live++] = next_offset++;
+        }
+        ++ n;
+    }
+    free(live);
+
+    trace->count = n;
+    return 1;
+}
+
+
+/*****             replay              *****/
+
+static int replay(const trace_t *trace, alloc_policy policy, replay_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    result->alloc_ns = malloc((trace->count + 1) * sizeof(unsigned long long));
+
+    live_map_t live;
+    size_t max_pools = 16, num_pools = 0;
+    replay_pool_t *pools = calloc(max_pools, sizeof(replay_pool_t));
+    if (!result->alloc_ns || !pools || !live_init(&live)) return 0;
+
+    if (mem_init() != ALLOC_OK) return 0;
+
+    double fragmentation_sum = 0.0;
+    size_t fragmentation_count = 0;
+
+    unsigned long long start = now_ns();
+    for (size_t i = 0; i < trace->count; ++i) {
+        const trace_record_t *rec = &trace->records[i];
+        replay_pool_t *rp;
+
+        switch (rec->op) {
+            case MEM_TRACE_OPEN:
+                if (rec->result != ALLOC_OK) break;
+                if (num_pools == max_pools) {
+                    max_pools *= 2;
+                    pools = realloc(pools, max_pools * sizeof(replay_pool_t));
+                }
+                pools[num_pools].id = rec->pool_id;
+                pools[num_pools].pool = mem_pool_open(rec->size, policy);
+                pools[num_pools].fragmentation = 0.0;
+                num_pools ++;
+                break;
+
+            case MEM_TRACE_ALLOC: {
+                if (!(rp = find_pool(pools, num_pools, rec->pool_id)) || !rp->pool) break;
+
+                unsigned long long t0 = now_ns();
+                void *alloc = mem_new_alloc(rp->pool, rec->size);
+                result->alloc_ns[result->num_allocs++] = now_ns() - t0;
+
+                if (!alloc) result->num_failed ++;
+                else if (rec->offset != UINT64_MAX) live_put(&live, rec->pool_id, rec->offset, alloc);
+                break;
+            }
+
+            case MEM_TRACE_FREE: {
+                if (rec->result != ALLOC_OK) break;
+                if (!(rp = find_pool(pools, num_pools, rec->pool_id))) break;
+
+                // allocations that failed under this policy have nothing to free
+                void *alloc = live_take(&live, rec->pool_id, rec->offset);
+                if (alloc) mem_del_alloc(rp->pool, alloc);
+                break;
+            }
+
+            case MEM_TRACE_CLEAR:
+                if (rec->result != ALLOC_OK) break;
+                if (!(rp = find_pool(pools, num_pools, rec->pool_id))) break;
+
+                if (mem_pool_clear(rp->pool) == ALLOC_OK) live_drop_pool(&live, rec->pool_id);
+                break;
+
+            case MEM_TRACE_CLOSE:
+                if (rec->result != ALLOC_OK) break;
+                if (!(rp = find_pool(pools, num_pools, rec->pool_id))) break;
+
+                fragmentation_sum += pool_fragmentation(rp->pool, &result->peak_alloc_size);
+                fragmentation_count ++;
+                // forced, as the recorded close may have been, and this
+                // policy may have placed what the recording failed to
+                if (mem_pool_close_force(rp->pool) == ALLOC_OK) {
+                    rp->pool = NULL;
+                    live_drop_pool(&live, rec->pool_id);
+                }
+                break;
+        }
+        result->ops ++;
+    }
+    result->seconds = (now_ns() - start) / 1e9;
+
+    // pools still open at the end of the trace: measure, then tear down
+    for (size_t p = 0; p < num_pools; ++p) {
+        if (!pools[p].pool) continue;
+        fragmentation_sum += pool_fragmentation(pools[p].pool, &result->peak_alloc_size);
+        fragmentation_count ++;
+    }
+    result->fragmentation = fragmentation_count ? fragmentation_sum / fragmentation_count : 0.0;
+
+    for (size_t i = 0; i < live.capacity; ++i) {
+        if (!live.slots[i].alloc) continue;
+        replay_pool_t *rp = find_pool(pools, num_pools, live.slots[i].pool_id);
+        if (rp) mem_del_alloc(rp->pool, live.slots[i].alloc);
+    }
+    for (size_t p = 0; p < num_pools; ++p)
+        if (pools[p].pool) mem_pool_close(pools[p].pool);
+    mem_free();
+
+    free(live.slots);
+    free(pools);
+    return 1;
+}
+
+static void report(const char *name, replay_result_t *result) {
+    unsigned long long p50 = 0, p99 = 0, p999 = 0;
+
+    if (result->num_allocs) {
+        qsort(result->alloc_ns, result->num_allocs, sizeof(unsigned long long), compare_ull);
+        p50  = result->alloc_ns[(size_t) (0.50  * (result->num_allocs - 1))];
+        p99  = result->alloc_ns[(size_t) (0.99  * (result->num_allocs - 1))];
+        p999 = result->alloc_ns[(size_t) (0.999 * (result->num_allocs - 1))];
+    }
+
+    printf("%-10s %12.0f %8llu %8llu %8llu %14zu %8.3f%% %8.3f\n",
+           name,
+           result->seconds > 0 ? result->ops / result->seconds : 0.0,
+           p50, p99, p999,
+           result->peak_alloc_size,
+           result->num_allocs ? 100.0 * result->num_failed / result->num_allocs : 0.0,
+           result->fragmentation);
+}
+
+
+/*****              main               *****/
+
+int main(int argc, char *argv[]) {
+    trace_t trace = { NULL, 0 };
+
+    if (argc >= 2 && strcmp(argv[1], "--synthetic") == 0) {
+        unsigned num_ops = argc >= 3 ? (unsigned) strtoul(argv[2], NULL, 10) : SYNTH_DEFAULT_OPS;
+        unsigned seed = argc >= 4 ? (unsigned) strtoul(argv[3], NULL, 10) : 1;
+        if (!synthesize_trace(num_ops, seed, &trace)) return 1;
+        printf("synthetic trace: %zu records, seed %u\n", trace.count, seed);
+    } else if (argc == 2) {
+        if (!load_trace(argv[1], &trace)) return 1;
+        printf("trace %s: %zu records\n", argv[1], trace.count);
+    } else {
+        fprintf(stderr, "usage: %s <trace-file> | --synthetic [num_ops [seed]]\n", argv[0]);
+        return 2;
+    }
+
+    printf("%-10s %12s %8s %8s %8s %14s %9s %8s\n",
+           "policy", "ops/s", "p50 ns", "p99 ns", "p999 ns", "peak alloc", "failed", "frag");
+
+    for (unsigned p = 0; p < NUM_POLICIES; ++p) {
+        replay_result_t result;
+        if (!replay(&trace, POLICIES[p], &result)) {
+            fprintf(stderr, "%s: replay failed\n", POLICY_NAMES[p]);
+            return 1;
+        }
+        report(POLICY_NAMES[p], &result);
+        free(result.alloc_ns);
+    }
+
+    free(trace.records);
+    return 0;
+}
@@ -2,8 +2,13 @@
 // Created by Ivo Georgiev on 3/3/16.
 //
 
+#define _POSIX_C_SOURCE 200809L // for fork() and waitpid()
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -11,6 +16,7 @@
 #include "cmocka.h"
 
 #include "mem_pool.h"
+#include "mem_pool_spec.h"
 #include "test_suite.h"
 
 
@@ -2393,7 +2399,1262 @@ void test_pool_stresstest0(void **state) {
 
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***        6. INSTRUMENTATION           ***/
+/*******************************************/
+
+static void test_pool_stats(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t stats;
+
+    /*
+     * Uses the allocation pattern of scenario 17:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 10 x 100.
+     * 3. Deallocate 2, 1, 6.
+     * 4. Check the gaps, fragmentation and counters.
+     * 5. Fail an allocation that doesn't fit anywhere.
+     * 6. Clean up.
+     */
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, pool->total_size);
+    assert_int_equal(stats.free_size, pool->total_size);
+    assert_true(stats.fragmentation == 0.0);
+    assert_int_equal(stats.alloc_count, 0);
+
+
+    const unsigned NUM_ALLOCS = 10;
+    void * allocs[NUM_ALLOCS];
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK); allocs[2]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[6]), ALLOC_OK); allocs[6]=0;
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, pool->total_size - 1000);
+    assert_int_equal(stats.free_size, pool->total_size - 700);
+    assert_true(stats.fragmentation > 0.0 && stats.fragmentation < 1.0);
+    assert_int_equal(stats.peak_alloc_size, 1000);
+    assert_int_equal(stats.alloc_count, 10);
+    assert_int_equal(stats.free_count, 3);
+    assert_int_equal(stats.split_count, 10);
+    assert_int_equal(stats.coalesce_count, 1);
+    assert_int_equal(stats.gap_hist[6], 1); // 100
+    assert_int_equal(stats.gap_hist[7], 1); // 200
+    assert_true(stats.avg_search_len >= 1.0);
+
+
+    assert_null(mem_new_alloc(pool, pool->total_size));
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.fail_count, 1);
+
+
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, pool->total_size);
+    assert_true(stats.fragmentation == 0.0);
+    assert_int_equal(stats.free_count, 10);
+}
+
+static void test_pool_latency(void **state) {
+    pool_pt pool = *state;
+    latency_hist_t hist;
+
+    /*
+     * 1. Allocate and deallocate 10 x 100.
+     * 2. In an instrumentation build, check the histograms; otherwise
+     *    check that the snapshot is refused.
+     * 3. Reset and check the histograms are empty.
+     */
+
+    const unsigned NUM_ALLOCS = 10;
+    void * allocs[NUM_ALLOCS];
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+
+#ifdef MEM_POOL_LATENCY
+    assert_int_equal(mem_pool_latency(pool, MEM_LAT_ALLOC, &hist), ALLOC_OK);
+    assert_int_equal(hist.count, NUM_ALLOCS);
+    assert_true(hist.min <= hist.max);
+    assert_true(mem_latency_percentile(&hist, 0.5) <= mem_latency_percentile(&hist, 0.99));
+    assert_true(mem_latency_percentile(&hist, 0.999) <= hist.max);
+
+    assert_int_equal(mem_pool_latency(pool, MEM_LAT_FREE, &hist), ALLOC_OK);
+    assert_int_equal(hist.count, NUM_ALLOCS);
+
+    assert_int_equal(mem_pool_latency(pool, MEM_LAT_SEARCH, &hist), ALLOC_OK);
+    assert_int_equal(hist.count, NUM_ALLOCS);
+
+    assert_int_equal(mem_pool_latency_reset(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_latency(pool, MEM_LAT_ALLOC, &hist), ALLOC_OK);
+    assert_int_equal(hist.count, 0);
+    assert_int_equal(mem_latency_percentile(&hist, 0.99), 0);
+#else
+    assert_int_equal(mem_pool_latency(pool, MEM_LAT_ALLOC, &hist), ALLOC_FAIL);
+    assert_int_equal(mem_pool_latency_reset(pool), ALLOC_FAIL);
+#endif
+}
+
+static void test_pool_trace(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open a pool, allocate 100, deallocate it, close the pool.
+     * 2. In a tracing build, dump the trace and read back the four
+     *    events in order; otherwise check that the dump is refused.
+     */
+
+    const char *path = "mem_pool_trace_test.bin";
+
+#ifdef MEM_POOL_TRACE
+    assert_int_equal(mem_trace_reset(), ALLOC_OK);
+#endif
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    void * alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+
+#ifdef MEM_POOL_TRACE
+    assert_int_equal(mem_trace_dump(path), ALLOC_OK);
+
+    FILE *file = fopen(path, "rb");
+    assert_non_null(file);
+
+    trace_file_header_t header;
+    trace_record_t records[4];
+    assert_int_equal(fread(&header, sizeof(header), 1, file), 1);
+    assert_int_equal(header.magic, MEM_TRACE_MAGIC);
+    assert_int_equal(header.record_size, sizeof(trace_record_t));
+    assert_int_equal(header.count, 4);
+    assert_int_equal(fread(records, sizeof(trace_record_t), 4, file), 4);
+    fclose(file);
+    remove(path);
+
+    assert_int_equal(records[0].op, MEM_TRACE_OPEN);
+    assert_int_equal(records[0].size, POOL_SIZE);
+    assert_int_equal(records[1].op, MEM_TRACE_ALLOC);
+    assert_int_equal(records[1].offset, 0);
+    assert_int_equal(records[1].size, 100);
+    assert_int_equal(records[1].result, ALLOC_OK);
+    assert_int_equal(records[2].op, MEM_TRACE_FREE);
+    assert_int_equal(records[2].offset, 0);
+    assert_int_equal(records[3].op, MEM_TRACE_CLOSE);
+    for (int i=0; i<4; ++i) {
+        assert_int_equal(records[i].pool_id, records[0].pool_id);
+    }
+    assert_true(records[0].timestamp <= records[3].timestamp);
+#else
+    assert_int_equal(mem_trace_dump(path), ALLOC_FAIL);
+#endif
+}
+
+
+/*******************************************/
+/***        7. POOL BACKING              ***/
+/*******************************************/
+
+static void test_pool_file(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open a file-backed pool, allocate 3 x 100 and fill them.
+     * 2. Deallocate the middle one, check a second open is refused.
+     * 3. Close the pool with the allocations still live.
+     * 4. Reattach (size 0) and check the segments and the contents.
+     * 5. Deallocate everything, close and remove the file.
+     * 6. Check a new file opened with size 0 is refused and not left behind.
+     */
+
+    const char *path = "mem_pool_file_test.bin";
+    const unsigned NUM_ALLOCS = 3;
+    void * allocs[NUM_ALLOCS];
+
+    remove(path);
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_file(path, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+        memset(allocs[i], 'a' + i, 100);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+
+    assert_null(mem_pool_open_file(path, 0, FIRST_FIT));
+    assert_int_equal(mem_pool_sync(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+
+    pool = mem_pool_open_file(path, 0, BEST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 200, 2, 2);
+
+    pool_segment_t exp[4] = {
+            {100, 1},
+            {100, 0},
+            {100, 1},
+            {POOL_SIZE - 300, 0}
+    };
+    check_pool(pool, exp);
+
+    // the allocations are at the same offsets in the new mapping
+    char *mem0 = pool->mem, *mem2 = pool->mem + 200;
+    for (int i=0; i<100; ++i) {
+        assert_int_equal(mem0[i], 'a');
+        assert_int_equal(mem2[i], 'c');
+    }
+
+    assert_int_equal(mem_del_alloc(pool, mem0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, mem2), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    remove(path);
+
+    assert_null(mem_pool_open_file(path, 0, FIRST_FIT));
+    assert_int_equal(access(path, F_OK), -1);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_shared(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Create a shared pool and attach to it a second time.
+     * 2. Allocate 100 through the first handle, pass its offset to a child
+     *    process, which fills it and allocates 200 through its own attach.
+     * 3. Check the contents and the metadata through the second handle.
+     * 4. Deallocate through the second handle, close both, unlink.
+     */
+
+    const char *name = "/mem_pool_shared_test";
+
+    mem_pool_unlink_shared(name);
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_shared(name, POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    pool_pt other = mem_pool_open_shared(name, 0, FIRST_FIT);
+    assert_non_null(other);
+    assert_true(pool != other);
+    check_metadata(other, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    void * alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    size_t offset = mem_pool_offset(pool, alloc);
+
+    fflush(stdout);
+    pid_t child = fork();
+    assert_true(child >= 0);
+    if (child == 0) {
+        // a separate process with its own mapping of the pool
+        pool_pt child_pool = mem_pool_open_shared(name, 0, FIRST_FIT);
+        if (!child_pool) _exit(2);
+        memset(mem_pool_ptr(child_pool, offset), 'x', 100);
+        if (!mem_new_alloc(child_pool, 200)) _exit(3);
+        _exit(mem_pool_close(child_pool) == ALLOC_OK ? 0 : 4);
+    }
+    int status = 0;
+    assert_int_equal(waitpid(child, &status, 0), child);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+
+    char *mem = mem_pool_ptr(other, offset);
+    for (int i=0; i<100; ++i) {
+        assert_int_equal(mem[i], 'x');
+    }
+    check_metadata(other, BEST_FIT, POOL_SIZE, 300, 2, 1);
+
+    assert_int_equal(mem_del_alloc(other, mem), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(other, mem + 100), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(other), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(mem_pool_unlink_shared(name), ALLOC_OK);
+}
+
+static void test_pool_snapshot(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * 1. Allocate 5 x 100 and fill them, deallocate 1 and 3.
+     * 2. Snapshot to a temporary file, check only live data was written.
+     * 3. Restore and check the metadata, segments and contents.
+     * 4. Check a truncated snapshot is refused.
+     */
+
+    const unsigned NUM_ALLOCS = 5;
+    void * allocs[NUM_ALLOCS];
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+        memset(allocs[i], 'a' + i, 100);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+
+    FILE *file = tmpfile();
+    assert_non_null(file);
+    int fd = fileno(file);
+
+    assert_int_equal(mem_pool_snapshot(pool, fd), ALLOC_OK);
+    off_t written = lseek(fd, 0, SEEK_CUR);
+    assert_true(written > 300 && written < 300 + 1024);
+
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    pool_pt restored = mem_pool_restore(fd);
+    assert_non_null(restored);
+    check_metadata(restored, FIRST_FIT, POOL_SIZE, 300, 3, 3);
+
+    pool_segment_t exp[6] = {
+            {100, 1},
+            {100, 0},
+            {100, 1},
+            {100, 0},
+            {100, 1},
+            {POOL_SIZE - 500, 0}
+    };
+    check_pool(restored, exp);
+
+    for (int i=0; i<NUM_ALLOCS; i+=2) {
+        char *mem = restored->mem + ((char *) allocs[i] - pool->mem);
+        for (int j=0; j<100; ++j) {
+            assert_int_equal(mem[j], 'a' + i);
+        }
+        assert_int_equal(mem_del_alloc(restored, mem), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(restored), ALLOC_OK);
+
+    // cut off in the middle of the data
+    assert_int_equal(ftruncate(fd, written - 50), 0);
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_null(mem_pool_restore(fd));
+
+    fclose(file);
+}
+
+static void test_pool_clone(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open an anonymous file-backed pool, a template pool and a heap
+     *    pool, allocate 2 x 100 in each and fill them.
+     * 2. Clone each, check the metadata and contents of the clones.
+     * 3. Write and allocate in the clones, check the parents don't change.
+     * 4. Close the clones with live allocations, clean up the parents.
+     * 5. Clone a template with 100 and 256 KiB allocated and filled, then
+     *    overwrite the 100 and allocate and fill 4 KiB in the template,
+     *    check the clone sees neither and zeroes its own 4 KiB.
+     * 6. Clone the template again, check the new clone sees the writes.
+     * 7. Deallocate the 256 KiB in the template and run maintenance, check
+     *    the clones keep it; the template can't close while they are open.
+     * 8. Close the clones, deallocate the rest in the template and run
+     *    maintenance, check the pages are released and read zero.
+     * 9. Check a template pool can't be embedded.
+     */
+
+    const pool_open_opts_t template = { 0, 0, 0, MEM_OPEN_TEMPLATE };
+    const pool_open_opts_t embedded = { 0, 0, 0, MEM_OPEN_TEMPLATE | MEM_OPEN_EMBEDDED };
+    pool_pt parents[3];
+    void * allocs[3][2];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    parents[0] = mem_pool_open_file(NULL, POOL_SIZE, FIRST_FIT);
+    parents[1] = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &template);
+    parents[2] = mem_pool_open(POOL_SIZE, FIRST_FIT);
+
+    for (int p=0; p<3; ++p) {
+        assert_non_null(parents[p]);
+        for (int i=0; i<2; ++i) {
+            allocs[p][i] = mem_new_alloc(parents[p], 100);
+            assert_non_null(allocs[p][i]);
+            memset(allocs[p][i], 'a' + i, 100);
+        }
+
+        pool_pt clone = mem_pool_clone(parents[p]);
+        assert_non_null(clone);
+        check_metadata(clone, FIRST_FIT, POOL_SIZE, 200, 2, 1);
+
+        char *mem = clone->mem + 100;
+        assert_int_equal(mem[0], 'b');
+        assert_int_equal(mem[99], 'b');
+
+        memset(mem, 'x', 100);
+        assert_non_null(mem_new_alloc(clone, 300));
+        check_metadata(clone, FIRST_FIT, POOL_SIZE, 500, 3, 1);
+
+        assert_int_equal(((char *) allocs[p][1])[0], 'b');
+        check_metadata(parents[p], FIRST_FIT, POOL_SIZE, 200, 2, 1);
+
+        assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+
+        for (int i=0; i<2; ++i) {
+            assert_int_equal(mem_del_alloc(parents[p], allocs[p][i]), ALLOC_OK);
+        }
+        assert_int_equal(mem_pool_close(parents[p]), ALLOC_OK);
+    }
+
+    const size_t large = 256 * 1024;
+    pool_pt tmpl = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &template);
+    assert_non_null(tmpl);
+    char *small = mem_new_alloc(tmpl, 100);
+    char *big = mem_new_alloc(tmpl, large);
+    assert_non_null(small);
+    assert_non_null(big);
+    memset(small, 'a', 100);
+    memset(big, 'a', large);
+
+    pool_pt clones[2];
+    clones[0] = mem_pool_clone(tmpl);
+    assert_non_null(clones[0]);
+
+    memset(small, 'P', 100);
+    char *page = mem_new_alloc(tmpl, 4096);
+    assert_true(page == big + large);
+    memset(page, 'S', 4096);
+
+    assert_int_equal(clones[0]->mem[0], 'a');
+    char *zeroed = mem_new_alloc_zeroed(clones[0], 4096);
+    assert_true(zeroed == clones[0]->mem + 100 + large);
+    for (size_t i=0; i<4096; ++i) {
+        assert_int_equal(zeroed[i], 0);
+    }
+
+    clones[1] = mem_pool_clone(tmpl);
+    assert_non_null(clones[1]);
+    assert_int_equal(clones[1]->mem[0], 'P');
+    assert_int_equal(clones[1]->mem[100 + large], 'S');
+    assert_int_equal(clones[1]->mem[100 + large + 4095], 'S');
+    assert_int_equal(clones[1]->mem[100], 'a');
+
+    pool_stats_t stats;
+    assert_int_equal(mem_del_alloc(tmpl, big), ALLOC_OK);
+    assert_int_equal(mem_maint_run(), ALLOC_OK);
+    assert_int_equal(mem_pool_stats(tmpl, &stats), ALLOC_OK);
+    assert_int_equal(stats.released_size, 0);
+    for (int c=0; c<2; ++c) {
+        assert_int_equal(clones[c]->mem[100], 'a');
+        assert_int_equal(clones[c]->mem[100 + large - 1], 'a');
+    }
+    assert_int_equal(mem_pool_close(tmpl), ALLOC_NOT_FREED);
+
+    for (int c=0; c<2; ++c) {
+        assert_int_equal(mem_pool_close(clones[c]), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(tmpl, small), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(tmpl, page), ALLOC_OK);
+    assert_int_equal(mem_maint_run(), ALLOC_OK);
+    assert_int_equal(mem_pool_stats(tmpl, &stats), ALLOC_OK);
+    assert_true(stats.released_size > 0);
+    char *all = mem_new_alloc_zeroed(tmpl, POOL_SIZE);
+    assert_true(all == tmpl->mem);
+    assert_int_equal(all[0], 0);
+    assert_int_equal(all[100 + large], 0);
+    assert_int_equal(all[100 + large + 4095], 0);
+    assert_int_equal(mem_del_alloc(tmpl, all), ALLOC_OK);
+    assert_int_equal(mem_pool_close(tmpl), ALLOC_OK);
+
+    assert_null(mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &embedded));
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_numa(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open pools on the local node and interleaved, allocate and
+     *    deallocate 100 in each.
+     * 2. Check an invalid node is refused.
+     */
+
+    int nodes[2] = { mem_numa_local_node(), MEM_NUMA_INTERLEAVE };
+
+    assert_true(nodes[0] >= 0);
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (int n=0; n<2; ++n) {
+        pool_pt pool = mem_pool_open_numa(POOL_SIZE, BEST_FIT, nodes[n]);
+        assert_non_null(pool);
+        check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+        void * alloc = mem_new_alloc(pool, 100);
+        assert_non_null(alloc);
+        memset(alloc, 'a', 100);
+        assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_null(mem_pool_open_numa(POOL_SIZE, BEST_FIT, -2));
+    assert_null(mem_pool_open_numa(POOL_SIZE, BEST_FIT, 1 << 20));
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_open_on(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open a pool on a static arena that holds garbage, and check the
+     *    allocations come from it.
+     * 2. Allocate zeroed, and check the garbage is cleared.
+     * 3. Check closing refuses while the pool isn't empty, then clean up,
+     *    and check the arena is still the caller's to use.
+     * 4. Check a missing buffer is refused.
+     */
+
+    enum { ARENA_SIZE = 1 << 20 };
+    static char arena[ARENA_SIZE];
+    memset(arena, 'x', ARENA_SIZE);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_on(arena, ARENA_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_true(pool->mem == arena);
+    check_metadata(pool, FIRST_FIT, ARENA_SIZE, 0, 0, 1);
+
+    char * alloc0 = mem_new_alloc(pool, 100);
+    assert_true(alloc0 == arena);
+    unsigned char * alloc1 = mem_new_alloc_zeroed(pool, 1000);
+    assert_true((char *) alloc1 == arena + 100);
+    for (int i=0; i<1000; ++i) assert_int_equal(alloc1[i], 0);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    memset(arena, 'y', ARENA_SIZE);
+
+    assert_null(mem_pool_open_on(NULL, ARENA_SIZE, FIRST_FIT));
+    assert_null(mem_pool_open_on(arena, 0, FIRST_FIT));
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_subpool(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open a sub-pool of a pool, and a sub-pool of that one, and check
+     *    each is a single allocation in its parent.
+     * 2. Allocate 100 x 50 in each, and check the parents refuse to close.
+     * 3. Close the sub-pools with their allocations still in, and check
+     *    the parent is empty again.
+     * 4. Clean up.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    void * alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+
+    pool_pt sub = mem_subpool_open(pool, 20000, BEST_FIT);
+    assert_non_null(sub);
+    assert_true(sub->mem == pool->mem + 100);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 20100, 2, 1);
+    check_metadata(sub, BEST_FIT, 20000, 0, 0, 1);
+
+    pool_pt subsub = mem_subpool_open(sub, 10000, FIRST_FIT);
+    assert_non_null(subsub);
+    assert_true(subsub->mem == sub->mem);
+    check_metadata(sub, BEST_FIT, 20000, 10000, 1, 1);
+
+    for (int i=0; i<100; ++i) {
+        assert_non_null(mem_new_alloc(sub, 50));
+        assert_non_null(mem_new_alloc(subsub, 50));
+    }
+    check_metadata(sub, BEST_FIT, 20000, 15000, 101, 1);
+    check_metadata(subsub, FIRST_FIT, 10000, 5000, 100, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_close(sub), ALLOC_NOT_FREED);
+
+    assert_int_equal(mem_pool_close(subsub), ALLOC_OK);
+    check_metadata(sub, BEST_FIT, 20000, 5000, 100, 2);
+    assert_int_equal(mem_pool_close(sub), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 100, 1, 1);
+
+    assert_null(mem_subpool_open(pool, 2 * POOL_SIZE, FIRST_FIT));
+    assert_null(mem_subpool_open(NULL, 100, FIRST_FIT));
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***  8. GAP INDEX, NODE HEAP, ADAPTIVE  ***/
+/*******************************************/
+
+static void test_pool_gap_index(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Many gaps, so the index is more than a handful of entries deep.
+     * Uses a file-backed pool, which has metadata for many nodes.
+     *
+     * 1. Allocate 1000 blocks of assorted sizes, deallocate every other
+     *    one, leaving 500 holes between allocations.
+     * 2. For a range of requests, check BEST_FIT picks the smallest hole
+     *    that fits, at the lowest address among equal holes, and that
+     *    deallocating restores the hole.
+     * 3. Check the largest gap is the tail of the pool and clean up.
+     */
+
+    enum { NUM_ALLOCS = 1000 };
+    void * allocs[NUM_ALLOCS];
+    size_t sizes[NUM_ALLOCS];
+    size_t total = 0;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_file(NULL, POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        sizes[i] = 8 + (size_t) (i * 37) % 200;
+        allocs[i] = mem_new_alloc(pool, sizes[i]);
+        assert_non_null(allocs[i]);
+        total += sizes[i];
+    }
+    for (int i=0; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_gaps, NUM_ALLOCS / 2 + 1);
+
+    for (size_t request=1; request<=210; request+=7) {
+        // the expected hole, by brute force
+        int expected = -1;
+        for (int i=0; i<NUM_ALLOCS; i+=2) {
+            if (sizes[i] >= request && (expected < 0 || sizes[i] < sizes[expected]))
+                expected = i;
+        }
+
+        void * alloc = mem_new_alloc(pool, request);
+        assert_non_null(alloc);
+        if (expected < 0) {
+            assert_true(alloc == pool->mem + total);
+        } else {
+            assert_true(alloc == allocs[expected]);
+        }
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+        assert_int_equal(pool->num_gaps, NUM_ALLOCS / 2 + 1);
+    }
+
+    pool_stats_t stats;
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE - total);
+
+    for (int i=1; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_gap_index_first_fit(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * As test_pool_gap_index, but for FIRST_FIT.
+     *
+     * 1. Allocate 1000 blocks of assorted sizes, deallocate every other
+     *    one, leaving 500 holes between allocations.
+     * 2. For a range of requests, check FIRST_FIT picks the hole with the
+     *    lowest address that fits, and that deallocating restores it.
+     * 3. Deallocate the rest and clean up.
+     */
+
+    enum { NUM_ALLOCS = 1000 };
+    void * allocs[NUM_ALLOCS];
+    size_t sizes[NUM_ALLOCS];
+    size_t total = 0;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_file(NULL, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        sizes[i] = 8 + (size_t) (i * 37) % 200;
+        allocs[i] = mem_new_alloc(pool, sizes[i]);
+        assert_non_null(allocs[i]);
+        total += sizes[i];
+    }
+    for (int i=0; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_gaps, NUM_ALLOCS / 2 + 1);
+
+    for (size_t request=1; request<=210; request+=7) {
+        // the expected hole, by brute force
+        int expected = -1;
+        for (int i=0; i<NUM_ALLOCS && expected < 0; i+=2) {
+            if (sizes[i] >= request) expected = i;
+        }
+
+        void * alloc = mem_new_alloc(pool, request);
+        assert_non_null(alloc);
+        if (expected < 0) {
+            assert_true(alloc == pool->mem + total);
+        } else {
+            assert_true(alloc == allocs[expected]);
+        }
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+        assert_int_equal(pool->num_gaps, NUM_ALLOCS / 2 + 1);
+    }
+
+    for (int i=1; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_open_ex(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open pools hinted for 1000 allocations, directly and through the
+     *    typical size, and one with no hints.
+     * 2. In each, allocate 1000 x 100 and deallocate every other one.
+     * 3. Check the hinted pools never grew their metadata, and the other did.
+     * 4. Clean up.
+     */
+
+    enum { NUM_ALLOCS = 1000 };
+    const pool_open_opts_t by_count = { NUM_ALLOCS, 0, 0 };
+    const pool_open_opts_t by_size = { 0, POOL_SIZE / NUM_ALLOCS, 0 };
+    void * allocs[NUM_ALLOCS];
+    pool_stats_t stats;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pools[3] = {
+        mem_pool_open_ex(POOL_SIZE, BEST_FIT, &by_count),
+        mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &by_size),
+        mem_pool_open_ex(POOL_SIZE, FIRST_FIT, NULL),
+    };
+
+    for (int p=0; p<3; ++p) {
+        assert_non_null(pools[p]);
+        for (int i=0; i<NUM_ALLOCS; ++i) {
+            allocs[i] = mem_new_alloc(pools[p], 100);
+            assert_non_null(allocs[i]);
+        }
+        for (int i=0; i<NUM_ALLOCS; i+=2) {
+            assert_int_equal(mem_del_alloc(pools[p], allocs[i]), ALLOC_OK);
+        }
+
+        assert_int_equal(mem_pool_stats(pools[p], &stats), ALLOC_OK);
+        if (p < 2) {
+            assert_int_equal(stats.resize_count, 0);
+        } else {
+            assert_true(stats.resize_count > 0);
+        }
+
+        for (int i=1; i<NUM_ALLOCS; i+=2) {
+            assert_int_equal(mem_del_alloc(pools[p], allocs[i]), ALLOC_OK);
+        }
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_open_embedded(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open an embedded pool, and check its memory is right after its
+     *    metadata, in the same mapping as the pool itself.
+     * 2. Allocate 1000 x 100, deallocate every other one, and check the
+     *    gaps and the metadata never grew.
+     * 3. Reallocate into the gaps, then check closing refuses while the
+     *    pool isn't empty.
+     * 4. Clean up.
+     */
+
+    enum { NUM_ALLOCS = 1000 };
+    const pool_open_opts_t embedded = { 0, 0, 0, MEM_OPEN_EMBEDDED };
+    void * allocs[NUM_ALLOCS];
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    pool_stats_t stats;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &embedded);
+    assert_non_null(pool);
+    assert_true(pool->mem > (char *) pool);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+        assert_true((char *) allocs[i] == pool->mem + 100 * i);
+    }
+    for (int i=0; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_gaps, NUM_ALLOCS / 2 + 1);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.resize_count, 0);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, NUM_ALLOCS + 1);
+    free(segs);
+
+    for (int i=0; i<NUM_ALLOCS; i+=2) {
+        void * alloc = mem_new_alloc(pool, 100);
+        assert_true(alloc == allocs[i]);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_clear(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. In a heap pool and an embedded one, allocate 1000 and 100 x 100
+     *    and deallocate every third one.
+     * 2. Clear both, and check each is a single gap again, refuses what
+     *    was allocated before, and allocates from the start.
+     * 3. Check a pool filled by a single allocation is cleared too.
+     * 4. Check a pool with an open sub-pool isn't cleared or closed, even
+     *    by force, then force close both with allocations in them.
+     */
+
+    const pool_open_opts_t embedded = { 0, 0, 0, MEM_OPEN_EMBEDDED };
+    const int num_allocs[2] = { 1000, 100 };
+    void * allocs[1000];
+    pool_stats_t stats;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pools[2] = {
+        mem_pool_open(POOL_SIZE, FIRST_FIT),
+        mem_pool_open_ex(POOL_SIZE, BEST_FIT, &embedded),
+    };
+
+    for (int p=0; p<2; ++p) {
+        assert_non_null(pools[p]);
+        for (int i=0; i<num_allocs[p]; ++i) {
+            allocs[i] = mem_new_alloc(pools[p], 100);
+            assert_non_null(allocs[i]);
+        }
+        for (int i=0; i<num_allocs[p]; i+=3) {
+            assert_int_equal(mem_del_alloc(pools[p], allocs[i]), ALLOC_OK);
+        }
+
+        assert_int_equal(mem_pool_clear(pools[p]), ALLOC_OK);
+        check_metadata(pools[p], p ? BEST_FIT : FIRST_FIT, POOL_SIZE, 0, 0, 1);
+        assert_int_equal(mem_pool_stats(pools[p], &stats), ALLOC_OK);
+        assert_int_equal(stats.largest_gap, POOL_SIZE);
+        assert_int_equal(mem_del_alloc(pools[p], allocs[1]), ALLOC_FAIL);
+
+        for (int i=0; i<num_allocs[p]; ++i) {
+            assert_true(mem_new_alloc(pools[p], 100) == allocs[i]);
+        }
+        check_metadata(pools[p], p ? BEST_FIT : FIRST_FIT, POOL_SIZE, 100 * num_allocs[p], num_allocs[p], 1);
+    }
+
+    pool_pt full = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(full);
+    assert_non_null(mem_new_alloc(full, POOL_SIZE));
+    check_metadata(full, FIRST_FIT, POOL_SIZE, POOL_SIZE, 1, 0);
+    assert_int_equal(mem_pool_clear(full), ALLOC_OK);
+    check_metadata(full, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_non_null(mem_new_alloc(full, POOL_SIZE));
+    assert_int_equal(mem_pool_close_force(full), ALLOC_OK);
+
+    pool_pt sub = mem_subpool_open(pools[0], 1000, FIRST_FIT);
+    assert_non_null(sub);
+    assert_non_null(mem_new_alloc(sub, 100));
+    assert_int_equal(mem_pool_clear(pools[0]), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_close_force(pools[0]), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_close(sub), ALLOC_OK);
+
+    assert_int_equal(mem_pool_close(pools[0]), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_close_force(pools[0]), ALLOC_OK);
+    assert_int_equal(mem_pool_close_force(pools[1]), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_adaptive(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open an ADAPTIVE pool, and check it starts out first-fit.
+     * 2. Bulk load 1024 x 100, and check it stays first-fit (unless that
+     *    means walking the node list, as without the gap trees).
+     * 3. Churn through 1024 frees and allocations of 24 or 100, and check
+     *    it's gone best-fit with size classes, rounding 100 up to 112,
+     *    but refusing SIZE_MAX rather than wrapping it round to 0.
+     * 4. Churn through 1024 of many different sizes, and check it keeps
+     *    best-fit but drops the size classes.
+     * 5. Clean up.
+     */
+
+    enum { WINDOW = 1024 };
+    void * allocs[WINDOW];
+    pool_stats_t stats;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, ADAPTIVE);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.active_policy, FIRST_FIT);
+    assert_int_equal(stats.size_classes, 0);
+
+    for (int i=0; i<WINDOW; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_true((char *) allocs[i] == pool->mem + 100 * i);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    unsigned long switches = stats.policy_switch_count;
+    assert_int_equal(switches, stats.active_policy == FIRST_FIT ? 0 : 1);
+
+    for (int i=0; i<WINDOW; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        allocs[i] = mem_new_alloc(pool, i % 2 ? 24 : 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.active_policy, BEST_FIT);
+    assert_int_equal(stats.size_classes, 1);
+    assert_int_equal(stats.policy_switch_count, switches + 1);
+
+    size_t alloc_size = pool->alloc_size;
+    void * rounded = mem_new_alloc(pool, 100);
+    assert_non_null(rounded);
+    assert_int_equal(pool->alloc_size, alloc_size + 112);
+    assert_null(mem_new_alloc(pool, SIZE_MAX));
+    assert_true(mem_new_alloc(pool, 100) != rounded);
+    assert_int_equal(pool->alloc_size, alloc_size + 224);
+    assert_int_equal(mem_del_alloc(pool, rounded), ALLOC_OK);
+
+    for (int i=0; i<WINDOW; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        allocs[i] = mem_new_alloc(pool, 1 + (i * 37) % 500);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.active_policy, BEST_FIT);
+    assert_int_equal(stats.size_classes, 0);
+    assert_int_equal(stats.policy_switch_count, switches + 2);
+
+    assert_int_equal(mem_pool_clear(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+// 24-byte objects on 16-byte boundaries, 64 to a slab
+MEM_POOL_SPECIALIZE(test_obj, 24, 16, BEST_FIT)
+
+static void test_pool_specialized(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Open a specialized allocator in its own pool, allocate 1000
+     *    objects, and check they are aligned, apart, and cut from a
+     *    single chunk.
+     * 2. Free 3 objects, and check they come back last freed first.
+     * 3. Check the pool still serves the generic API, and doesn't close
+     *    with the objects in, then free them and close it.
+     * 4. Open one in a sub-pool, allocate, free, close, and check the
+     *    parent is empty again.
+     */
+
+    enum { NUM_OBJS = 1000 };
+    char * objs[NUM_OBJS];
+    test_obj_t a;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_true(test_obj_open(&a, POOL_SIZE));
+    assert_int_equal(a.pool->policy, BEST_FIT);
+
+    for (int i=0; i<NUM_OBJS; ++i) {
+        objs[i] = test_obj_alloc(&a);
+        assert_non_null(objs[i]);
+        assert_int_equal((uintptr_t) objs[i] % 16, 0);
+        assert_true(objs[i] >= a.pool->mem && objs[i] + 24 <= a.pool->mem + POOL_SIZE);
+        if (i) assert_true(objs[i] == objs[i-1] + 32);
+        memset(objs[i], 'a', 24);
+    }
+    assert_int_equal(a.pool->num_allocs, 1);
+
+    test_obj_free(&a, objs[5]);
+    test_obj_free(&a, objs[7]);
+    test_obj_free(&a, objs[9]);
+    assert_true(test_obj_alloc(&a) == objs[9]);
+    assert_true(test_obj_alloc(&a) == objs[7]);
+    assert_true(test_obj_alloc(&a) == objs[5]);
+
+    void * alloc = mem_new_alloc(a.pool, 100);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(a.pool, alloc), ALLOC_OK);
+    assert_int_equal(test_obj_close(&a), ALLOC_NOT_FREED);
+    for (int i=0; i<NUM_OBJS; ++i) test_obj_free(&a, objs[i]);
+    assert_int_equal(test_obj_close(&a), ALLOC_OK);
+    assert_null(a.pool);
+
+    pool_pt parent = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(parent);
+    assert_true(test_obj_open_in(&a, parent, 10000));
+    for (int i=0; i<100; ++i) assert_non_null(objs[i] = test_obj_alloc(&a));
+    for (int i=0; i<100; ++i) test_obj_free(&a, objs[i]);
+    assert_int_equal(test_obj_close(&a), ALLOC_OK);
+    check_metadata(parent, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(parent), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_fast(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Take the fast path of a pool, allocate 1000 objects of 1 to 128
+     *    bytes, and check they are aligned and the pool holds only chunks.
+     * 2. Free them, allocate them again, and check no chunk was added.
+     * 3. Check a large request is a pool allocation, then free everything
+     *    and check the pool closes with the chunks, but only once the
+     *    last other allocation is gone (keeping the chunks until then).
+     * 4. In a pool smaller than a chunk, check allocation runs until the
+     *    pool is full, then clear it and allocate again.
+     */
+
+    enum { NUM_OBJS = 1000 };
+    char * objs[NUM_OBJS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    pool_fast_pt fast = mem_pool_fast(pool);
+    assert_non_null(fast);
+
+    for (int i=0; i<NUM_OBJS; ++i) {
+        objs[i] = mem_fast_alloc(fast, i % MEM_FAST_MAX + 1);
+        assert_non_null(objs[i]);
+        assert_int_equal((uintptr_t) objs[i] % MEM_FAST_GRAIN, 0);
+        memset(objs[i], 'a', i % MEM_FAST_MAX + 1);
+    }
+    unsigned chunks = pool->num_allocs;
+    assert_true(chunks > 0 && chunks < 4);
+    assert_int_equal(pool->alloc_size, chunks * MEM_FAST_CHUNK);
+
+    for (int i=0; i<NUM_OBJS; ++i) mem_fast_free(fast, objs[i], i % MEM_FAST_MAX + 1);
+    for (int i=0; i<NUM_OBJS; ++i) {
+        objs[i] = mem_fast_alloc(fast, i % MEM_FAST_MAX + 1);
+        assert_non_null(objs[i]);
+    }
+    assert_int_equal(pool->num_allocs, chunks);
+
+    char * large = mem_fast_alloc(fast, 1000);
+    assert_non_null(large);
+    assert_int_equal(pool->num_allocs, chunks + 1);
+    mem_fast_free(fast, large, 1000);
+    assert_int_equal(pool->num_allocs, chunks);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    for (int i=0; i<NUM_OBJS; ++i) mem_fast_free(fast, objs[i], i % MEM_FAST_MAX + 1);
+    large = mem_new_alloc(pool, 1000);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(pool->num_allocs, chunks + 1);
+    assert_int_equal(mem_del_alloc(pool, large), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(4096, BEST_FIT);
+    assert_non_null(pool);
+    fast = mem_pool_fast(pool);
+    int count = 0;
+    while (count < NUM_OBJS && (objs[count] = mem_fast_alloc(fast, 16))) ++count;
+    assert_true(count > 128 && count < 256);
+    assert_int_equal(mem_pool_clear(pool), ALLOC_OK);
+    assert_non_null(mem_fast_alloc(fast, 16));
+    assert_int_equal(mem_pool_close_force(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***   9. ZEROED ALLOCATION, MAINTENANCE ***/
+/*******************************************/
+
+static void test_pool_alloc_zeroed(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t stats;
+
+    /*
+     * 1. Allocate zeroed from the fresh pool, which needs no clearing.
+     * 2. Dirty it and a plain allocation after it, then deallocate both.
+     * 3. Allocate zeroed again, from the dirty gap, and check it's cleared.
+     * 4. Allocate a block large enough for non-temporal clearing from the
+     *    dirty gap, and check it's cleared.
+     * 5. Clean up.
+     */
+
+    const size_t LARGE = 300000;
+    unsigned char * alloc0 = mem_new_alloc_zeroed(pool, 1000);
+    assert_non_null(alloc0);
+    for (int i=0; i<1000; ++i) assert_int_equal(alloc0[i], 0);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.zero_skip_count, 1);
+    assert_int_equal(stats.zero_fill_count, 0);
+
+    unsigned char * alloc1 = mem_new_alloc(pool, LARGE);
+    assert_non_null(alloc1);
+    memset(alloc0, 0xff, 1000);
+    memset(alloc1, 0xff, LARGE);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    alloc0 = mem_new_alloc_zeroed(pool, 1000);
+    assert_non_null(alloc0);
+    for (int i=0; i<1000; ++i) assert_int_equal(alloc0[i], 0);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.zero_fill_count, 1);
+
+    unsigned char * alloc2 = mem_new_alloc_zeroed(pool, LARGE + 1000);
+    assert_non_null(alloc2);
+    for (size_t i=0; i<LARGE + 1000; ++i) assert_int_equal(alloc2[i], 0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.zero_fill_count, 2);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+}
+
+
+static void test_pool_maintenance(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t stats;
+
+    /*
+     * 1. Allocate 1000, 200000, 1000, 500, 1000 and dirty them.
+     * 2. Deallocate the first two (one large gap) and the 500 (a small one).
+     * 3. Run a maintenance pass: the large gap is released, the small one
+     *    is cleared, and zeroed allocations from either skip the clearing.
+     * 4. Leave more gaps than a pass takes in one lock hold, and check
+     *    one pass still clears them all.
+     * 5. Start the maintenance thread, keep allocating and deallocating
+     *    while it runs, then stop it.
+     * 6. Clean up.
+     */
+
+    const size_t sizes[] = { 1000, 200000, 1000, 500, 1000 };
+    unsigned char * allocs[5];
+    unsigned char * smalls[200];
+
+    for (int i=0; i<5; ++i) {
+        allocs[i] = mem_new_alloc(pool, sizes[i]);
+        assert_non_null(allocs[i]);
+        memset(allocs[i], 0xff, sizes[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+
+    assert_int_equal(mem_maint_run(), ALLOC_OK);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_true(stats.released_size > 0 && stats.released_size <= 201000);
+    assert_int_equal(stats.prezeroed_size, 500);
+
+    allocs[0] = mem_new_alloc_zeroed(pool, 201000);
+    assert_true((char *) allocs[0] == pool->mem);
+    allocs[3] = mem_new_alloc_zeroed(pool, 500);
+    assert_true(allocs[3] == allocs[2] + 1000);
+    for (int i=0; i<201000; ++i) assert_int_equal(allocs[0][i], 0);
+    for (int i=0; i<500; ++i) assert_int_equal(allocs[3][i], 0);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.zero_skip_count, 2);
+    assert_int_equal(stats.zero_fill_count, 0);
+
+    for (int i=0; i<200; ++i) {
+        smalls[i] = mem_new_alloc(pool, 100);
+        assert_non_null(smalls[i]);
+        memset(smalls[i], 0xff, 100);
+    }
+    for (int i=0; i<200; i+=2) assert_int_equal(mem_del_alloc(pool, smalls[i]), ALLOC_OK);
+    assert_int_equal(mem_maint_run(), ALLOC_OK);
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.prezeroed_size, 500 + 100 * 100);
+    for (int i=0; i<200; i+=2) {
+        assert_true(mem_new_alloc_zeroed(pool, 100) == smalls[i]);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.zero_fill_count, 0);
+    for (int i=0; i<200; ++i) assert_int_equal(mem_del_alloc(pool, smalls[i]), ALLOC_OK);
+
+    assert_int_equal(mem_maint_start(1), ALLOC_OK);
+    assert_int_equal(mem_maint_start(1), ALLOC_CALLED_AGAIN);
+    for (int round=0; round<2000; ++round) {
+        unsigned char * alloc = mem_new_alloc_zeroed(pool, 100 + round % 300);
+        assert_non_null(alloc);
+        assert_int_equal(alloc[round % 100], 0);
+        memset(alloc, 0xff, 100);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    assert_int_equal(mem_maint_stop(), ALLOC_OK);
+    assert_int_equal(mem_maint_stop(), ALLOC_CALLED_AGAIN);
+
+    // the first allocation took the place of the second as well
+    for (int i=0; i<5; ++i) {
+        if (i != 1) assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+}
+
+
+/*******************************************/
+/***        10. DRIVER ROUTINE           ***/
 /*******************************************/
 
 int run_test_suite() {
@@ -2404,35 +3665,63 @@ int run_test_suite() {
 
             cmocka_unit_test(test_pool_nonempty),
 
-//            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
 
             // First-fit tests
-//            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario02, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario03, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario04, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario05, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario06, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario07, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario08, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario09, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario10, pool_ff_setup, pool_ff_teardown),
 
             // Best-fit tests
-//            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
-//            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario11, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario12, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario13, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario14, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario15, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario16, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario17, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
 
             // Stress tests
-//            cmocka_unit_test(test_pool_stresstest0),
+            cmocka_unit_test(test_pool_stresstest0),
+
+            // Statistics tests
+            cmocka_unit_test_setup_teardown(test_pool_stats, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_latency, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_trace),
+
+            // Backing tests
+            cmocka_unit_test(test_pool_file),
+            cmocka_unit_test(test_pool_shared),
+            cmocka_unit_test_setup_teardown(test_pool_snapshot, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_clone),
+            cmocka_unit_test(test_pool_numa),
+            cmocka_unit_test(test_pool_open_on),
+            cmocka_unit_test(test_pool_subpool),
+
+            // Gap index and node heap tests
+            cmocka_unit_test(test_pool_gap_index),
+            cmocka_unit_test(test_pool_gap_index_first_fit),
+            cmocka_unit_test(test_pool_open_ex),
+            cmocka_unit_test(test_pool_open_embedded),
+            cmocka_unit_test(test_pool_clear),
+            cmocka_unit_test(test_pool_adaptive),
+            cmocka_unit_test(test_pool_specialized),
+            cmocka_unit_test(test_pool_fast),
+
+            // Zeroed allocation and maintenance tests
+            cmocka_unit_test_setup_teardown(test_pool_alloc_zeroed, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_maintenance, pool_ff_setup, pool_ff_teardown),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);